@@ -31,6 +31,15 @@ LOCAL_MODULE_TAGS := optional
 
 LOCAL_STATIC_LIBRARIES += libz
 LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt libselinux
+ifeq ($(MINZIP_USE_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+ifeq ($(MINZIP_HAVE_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+ifeq ($(MINZIP_HAVE_LZ4),true)
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libm liblog libcutils
 LOCAL_STATIC_LIBRARIES += libc
 
@@ -28,6 +28,7 @@
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 #include "edify/expr.h"
+#include "minzip/SysUtil.h"
 
 int SaveFileContents(const char* filename, FileContents file);
 static int LoadPartitionContents(const char* filename, FileContents* file);
@@ -285,15 +286,17 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 
 
 // Save the contents of the given FileContents object under the given
-// filename.  Return 0 on success.
+// filename, and make it durable before returning (callers delete the
+// original next).  Return 0 on success.
 int SaveFileContents(const char* filename, FileContents file) {
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, S_IRUSR | S_IWUSR);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
         printf("failed to open \"%s\" for write: %s\n",
                filename, strerror(errno));
         return -1;
     }
 
+    sysPreallocateFile(fd, file.size);
     ssize_t bytes_written = FileSink(file.data, file.size, &fd);
     if (bytes_written != file.size) {
         printf("short write of \"%s\" (%ld bytes of %ld) (%s)\n",
@@ -302,7 +305,6 @@ int SaveFileContents(const char* filename, FileContents file) {
         close(fd);
         return -1;
     }
-    fsync(fd);
     close(fd);
 
     if (chmod(filename, file.st.st_mode) != 0) {
@@ -314,6 +316,12 @@ int SaveFileContents(const char* filename, FileContents file) {
         return -1;
     }
 
+    // One flush for the data, the new directory entry and the metadata.
+    if (sysSyncFilesystem(filename) != 0) {
+        printf("sync of \"%s\" failed: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
     return 0;
 }
 
@@ -347,6 +355,12 @@ int WriteToPartition(unsigned char* data, size_t len,
                        partition, strerror(errno));
                 return -1;
             }
+            // The caller drops its backup of the old contents next.
+            if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+                printf("error syncing %s (%s)\n", partition, strerror(errno));
+                fclose(f);
+                return -1;
+            }
             if (fclose(f) != 0) {
                 printf("error closing %s (%s)\n", partition, strerror(errno));
                 return -1;
@@ -735,13 +749,16 @@ int applypatch(const char* source_filename,
             strcpy(outname, target_filename);
             strcat(outname, ".patch");
 
-            output = open(outname, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC,
+            // No O_SYNC: the file is flushed once, before it's renamed
+            // over the target.
+            output = open(outname, O_WRONLY | O_CREAT | O_TRUNC,
                 S_IRUSR | S_IWUSR);
             if (output < 0) {
                 printf("failed to open output file %s: %s\n",
                        outname, strerror(errno));
                 return 1;
             }
+            sysPreallocateFile(output, target_size);
             sink = FileSink;
             token = &output;
         }
@@ -767,7 +784,10 @@ int applypatch(const char* source_filename,
         }
 
         if (output >= 0) {
-            fsync(output);
+            if (result == 0 && fsync(output) != 0) {
+                printf("failed to sync %s: %s\n", outname, strerror(errno));
+                result = 1;
+            }
             close(output);
         }
 
@@ -819,6 +839,14 @@ int applypatch(const char* source_filename,
                    target_filename, strerror(errno));
             return 1;
         }
+
+        // Commit the rename (and anything else written to the target
+        // filesystem) before the backup of the source goes away.
+        if (sysSyncFilesystem(target_filename) != 0) {
+            printf("sync of \"%s\" failed: %s\n",
+                   target_filename, strerror(errno));
+            return 1;
+        }
     }
 
     // If this run of applypatch created the copy, and we're here, we
@@ -72,9 +72,26 @@ void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx);
+// As ApplyBSDiffPatch(), but into a new buffer holding the whole new
+// file.  The patch is decoded on up to "max_threads" threads besides
+// the caller's (0 for one per CPU); 1 keeps it all on the caller's.
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
+                        int max_threads,
                         unsigned char** new_data, ssize_t* new_size);
+#ifdef APPLYPATCH_BENCHMARK
+int BenchmarkAddOldData(const Value* patch, ssize_t patch_offset);
+#endif
+
+// bzdecode.c
+// Decompress the bzip2 stream at the start of "data", handing the output
+// to "sink" in order; blocks are decoded on up to "max_threads" threads
+// (0 for one per CPU).  Returns 0 on success.
+int ParallelBZ2Decompress(const unsigned char* data, ssize_t len,
+                          int max_threads, SinkFn sink, void* token);
+#ifdef APPLYPATCH_BENCHMARK
+int BenchmarkBZ2Patch(const Value* patch);
+#endif
 
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "applypatch.h"
+
+// Time libbz2 against the parallel decoder on the bzip2 streams of
+// each of the given patch files, and for bsdiff patches the
+// add-old-data loop on the patch's own diff runs.  Built (as
+// applypatch_bench) for eng builds only; the benchmarks aren't in
+// libapplypatch otherwise.
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: %s <patch> [<patch> ...]\n", argv[0]);
+        return 2;
+    }
+    int result = 0;
+    int i;
+    for (i = 1; i < argc; ++i) {
+        FileContents fc;
+        if (LoadFileContents(argv[i], &fc, RETOUCH_DONT_MASK) != 0) {
+            return 1;
+        }
+        Value patch = { VAL_BLOB, fc.size, (char*)fc.data };
+        printf("%s: ", argv[i]);
+        if (BenchmarkBZ2Patch(&patch) != 0) {
+            result = 1;
+        }
+        if (fc.size >= 8 && memcmp(fc.data, "BSDIFF40", 8) == 0) {
+            printf("%s: ", argv[i]);
+            if (BenchmarkAddOldData(&patch, 0) != 0) {
+                result = 1;
+            }
+        }
+        free(fc.data);
+    }
+    return result;
+}
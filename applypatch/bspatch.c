@@ -21,10 +21,19 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <bzlib.h>
 
@@ -90,39 +99,292 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
             printf("bz error %d decompressing\n", bzerr);
             return -1;
         }
-        if (stream->avail_out > 0) {
-            printf("need %d more bytes\n", stream->avail_out);
+        if (stream->avail_out > 0 &&
+            (bzerr == BZ_STREAM_END || stream->avail_in == 0)) {
+            printf("bz stream ended %d bytes short\n", stream->avail_out);
+            return -1;
         }
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    unsigned char* new_data;
+// ApplyBSDiffPatch() produces the new file this much at a time, so its
+// memory use doesn't grow with the size of the target.
+#define BSDIFF_WINDOW_SIZE (1024 * 1024)
+
+// Patches producing at least this much are decoded with one thread per
+// bzip2 stream; below it, starting the threads costs more than it saves.
+#define BSDIFF_THREAD_MIN_SIZE (1024 * 1024)
+
+// Each decoding thread stays up to this many blocks of this size ahead
+// of the apply loop.
+#define DECODE_SLOTS 4
+#define DECODE_SLOT_SIZE (128 * 1024)
+
+// Compressed streams at least this long are decoded a bzip2 block per
+// thread, by ParallelBZ2Decompress().
+#define PARALLEL_BZ2_MIN_SIZE (256 * 1024)
+
+// One of the bzip2 streams of a patch.  It is either decoded on demand
+// by ReadBZStream(), or, once StartDecodeThread() succeeds, decoded
+// ahead on its own thread into a ring of DECODE_SLOTS blocks.  The lock
+// is taken only to pass a whole block between the threads; copying out
+// of the current block touches nothing shared.
+typedef struct {
+    bz_stream stream;
+    const char* name;
+    int threaded;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;      // a block was decoded, or decoding stopped
+    pthread_cond_t drained;     // a block was consumed, or stop was set
+    unsigned char* slots[DECODE_SLOTS];
+    ssize_t lens[DECODE_SLOTS];
+    unsigned int num_filled;    // blocks ever decoded
+    unsigned int num_drained;   // blocks ever consumed
+    int finished;               // no more blocks will be decoded
+    int bzerr;                  // why, if it wasn't the end of the stream
+    int stop;                   // the reader is shutting down
+
+    // Decoding thread only, when the stream is decoded in parallel.
+    int max_threads;            // for ParallelBZ2Decompress()
+    int fill_slot;              // the block being filled, or -1
+    ssize_t fill_len;
+
+    // Consumer side only.
+    const unsigned char* cur;   // the block being read, or NULL
+    ssize_t cur_len;
+    ssize_t cur_pos;
+} BZReader;
+
+// The three bzip2 streams of a patch, and the size of the new file.
+typedef struct {
+    BZReader ctrl;    // control block
+    BZReader diff;    // diff block
+    BZReader extra;   // extra block
     ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
+} BSDiffStreams;
+
+static int InitBZStream(BZReader* r, const char* data, ssize_t len,
+                        const char* what) {
+    int bzerr;
+
+    memset(r, 0, sizeof(*r));
+    r->name = what;
+    r->stream.next_in = (char*)data;
+    r->stream.avail_in = len;
+    if ((bzerr = BZ2_bzDecompressInit(&r->stream, 0, 0)) != BZ_OK) {
+        printf("failed to bzinit %s stream (%d)\n", what, bzerr);
         return -1;
     }
+    return 0;
+}
+
+// Wait for a free block in the reader's ring and return its index, or
+// -1 if the reader is shutting down.  The consumer never touches the
+// block until it's published.
+static int ClaimSlot(BZReader* r) {
+    int slot = -1;
+
+    pthread_mutex_lock(&r->lock);
+    while (r->num_filled - r->num_drained == DECODE_SLOTS && !r->stop) {
+        pthread_cond_wait(&r->drained, &r->lock);
+    }
+    if (!r->stop) {
+        slot = r->num_filled % DECODE_SLOTS;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return slot;
+}
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+// Pass "len" decoded bytes in "slot" to the consumer.  If "finished",
+// that's the last of the stream; "bzerr" says why (0 for its end).
+static void PublishSlot(BZReader* r, int slot, ssize_t len,
+                        int finished, int bzerr) {
+    pthread_mutex_lock(&r->lock);
+    if (len > 0) {
+        r->lens[slot] = len;
+        r->num_filled++;
+    }
+    if (finished) {
+        r->finished = 1;
+        r->bzerr = bzerr;
+    }
+    pthread_cond_signal(&r->filled);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// SinkFn for ParallelBZ2Decompress(): copy its output into the ring.
+static ssize_t RingSink(unsigned char* data, ssize_t len, void* token) {
+    BZReader* r = (BZReader*) token;
+    ssize_t done = 0;
+
+    while (done < len) {
+        if (r->fill_slot < 0) {
+            r->fill_slot = ClaimSlot(r);
+            r->fill_len = 0;
+            if (r->fill_slot < 0) break;
+        }
+        ssize_t chunk = DECODE_SLOT_SIZE - r->fill_len;
+        if (chunk > len - done) chunk = len - done;
+        memcpy(r->slots[r->fill_slot] + r->fill_len, data + done, chunk);
+        r->fill_len += chunk;
+        done += chunk;
+        if (r->fill_len == DECODE_SLOT_SIZE) {
+            PublishSlot(r, r->fill_slot, r->fill_len, 0, 0);
+            r->fill_slot = -1;
+        }
+    }
+    return done;
+}
+
+// Decode a whole stream into the reader's ring, a block at a time.
+static void* DecodeThread(void* cookie) {
+    BZReader* r = (BZReader*) cookie;
+    bz_stream* stream = &r->stream;
+
+    if (r->max_threads > 1) {
+        r->fill_slot = -1;
+        int result = ParallelBZ2Decompress((unsigned char*)stream->next_in,
+                                           stream->avail_in, r->max_threads,
+                                           RingSink, r);
+        PublishSlot(r, r->fill_slot, r->fill_slot < 0 ? 0 : r->fill_len,
+                    1, result == 0 ? 0 : BZ_DATA_ERROR);
+        return NULL;
+    }
+
+    while (1) {
+        int slot = ClaimSlot(r);
+        if (slot < 0) break;
+
+        int bzerr = BZ_OK;
+        stream->next_out = (char*)r->slots[slot];
+        stream->avail_out = DECODE_SLOT_SIZE;
+        while (stream->avail_out > 0) {
+            unsigned int before = stream->avail_out;
+            bzerr = BZ2_bzDecompress(stream);
+            if (bzerr != BZ_OK ||
+                (stream->avail_in == 0 && stream->avail_out == before)) {
+                break;
+            }
+        }
+
+        int finished = stream->avail_out > 0 || bzerr == BZ_STREAM_END;
+        PublishSlot(r, slot, DECODE_SLOT_SIZE - stream->avail_out, finished,
+                    (bzerr == BZ_OK || bzerr == BZ_STREAM_END) ? 0 : bzerr);
+        if (finished) break;
+    }
+    return NULL;
+}
+
+// Start decoding "r" ahead on a thread of its own.  If that can't be
+// done, the stream is simply decoded on demand.
+static void StartDecodeThread(BZReader* r) {
+    int i;
+
+    for (i = 0; i < DECODE_SLOTS; ++i) {
+        r->slots[i] = malloc(DECODE_SLOT_SIZE);
+        if (r->slots[i] == NULL) goto fail;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->filled, NULL);
+    pthread_cond_init(&r->drained, NULL);
+    if (pthread_create(&r->thread, NULL, DecodeThread, r) != 0) {
+        pthread_cond_destroy(&r->drained);
+        pthread_cond_destroy(&r->filled);
+        pthread_mutex_destroy(&r->lock);
+        goto fail;
+    }
+    r->threaded = 1;
+    return;
+
+  fail:
+    for (i = 0; i < DECODE_SLOTS; ++i) {
+        free(r->slots[i]);
+        r->slots[i] = NULL;
+    }
+}
+
+static void StopDecodeThread(BZReader* r) {
+    int i;
+
+    if (!r->threaded) return;
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->drained);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    pthread_cond_destroy(&r->drained);
+    pthread_cond_destroy(&r->filled);
+    pthread_mutex_destroy(&r->lock);
+    for (i = 0; i < DECODE_SLOTS; ++i) {
+        free(r->slots[i]);
+        r->slots[i] = NULL;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+    r->threaded = 0;
+}
+
+// Read exactly "len" decoded bytes of "r" into "out".
+static int ReadBZStream(BZReader* r, unsigned char* out, ssize_t len) {
+    if (!r->threaded) {
+        return FillBuffer(out, len, &r->stream);
     }
-    free(new_data);
 
+    while (len > 0) {
+        if (r->cur_pos == r->cur_len) {
+            // Hand back the block just finished and wait for the next.
+            pthread_mutex_lock(&r->lock);
+            if (r->cur != NULL) {
+                r->cur = NULL;
+                r->num_drained++;
+                pthread_cond_signal(&r->drained);
+            }
+            while (r->num_filled == r->num_drained && !r->finished) {
+                pthread_cond_wait(&r->filled, &r->lock);
+            }
+            if (r->num_filled == r->num_drained) {
+                int bzerr = r->bzerr;
+                pthread_mutex_unlock(&r->lock);
+                if (bzerr != 0) {
+                    printf("bz error %d decompressing\n", bzerr);
+                } else {
+                    printf("bz stream ended %ld bytes short\n", (long)len);
+                }
+                return -1;
+            }
+            unsigned int slot = r->num_drained % DECODE_SLOTS;
+            r->cur = r->slots[slot];
+            r->cur_len = r->lens[slot];
+            r->cur_pos = 0;
+            pthread_mutex_unlock(&r->lock);
+        }
+
+        ssize_t chunk = r->cur_len - r->cur_pos;
+        if (chunk > len) chunk = len;
+        memcpy(out, r->cur + r->cur_pos, chunk);
+        r->cur_pos += chunk;
+        out += chunk;
+        len -= chunk;
+    }
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+static void CloseBSDiffPatch(BSDiffStreams* s) {
+    StopDecodeThread(&s->ctrl);
+    StopDecodeThread(&s->diff);
+    StopDecodeThread(&s->extra);
+    BZ2_bzDecompressEnd(&s->ctrl.stream);
+    BZ2_bzDecompressEnd(&s->diff.stream);
+    BZ2_bzDecompressEnd(&s->extra.stream);
+}
+
+// Open the bsdiff patch at "patch_offset" in "patch".  Its streams are
+// decoded on up to "max_threads" threads besides the caller's (0 for
+// one per CPU); with 1, everything is decoded on the calling thread.
+static int OpenBSDiffPatch(const Value* patch, ssize_t patch_offset,
+                           int max_threads, BSDiffStreams* s) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -135,6 +397,10 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
 
+    if (patch_offset < 0 || patch->size - patch_offset < 32) {
+        printf("corrupt bsdiff patch file header (truncated)\n");
+        return 1;
+    }
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
     if (memcmp(header, "BSDIFF40", 8) != 0) {
         printf("corrupt bsdiff patch file header (magic number)\n");
@@ -144,60 +410,158 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     ssize_t ctrl_len, data_len;
     ctrl_len = offtin(header+8);
     data_len = offtin(header+16);
-    *new_size = offtin(header+24);
+    s->new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (ctrl_len < 0 || data_len < 0 || s->new_size < 0 ||
+        ctrl_len > patch->size - patch_offset - 32 ||
+        data_len > patch->size - patch_offset - 32 - ctrl_len) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
 
-    int bzerr;
+    const char* data = patch->data + patch_offset + 32;
+    if (InitBZStream(&s->ctrl, data, ctrl_len, "control") != 0) {
+        return 1;
+    }
+    if (InitBZStream(&s->diff, data + ctrl_len, data_len, "diff") != 0) {
+        BZ2_bzDecompressEnd(&s->ctrl.stream);
+        return 1;
+    }
+    if (InitBZStream(&s->extra, data + ctrl_len + data_len,
+                     patch->size - (patch_offset + 32 + ctrl_len + data_len),
+                     "extra") != 0) {
+        BZ2_bzDecompressEnd(&s->ctrl.stream);
+        BZ2_bzDecompressEnd(&s->diff.stream);
+        return 1;
+    }
 
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
-    }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
-    }
-
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
-    }
-
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+    // bzip2 decoding is most of the work, and the three streams are
+    // independent, so decode them in parallel with the apply loop.
+    if (max_threads == 0) {
+        max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (s->new_size >= BSDIFF_THREAD_MIN_SIZE && max_threads > 1) {
+        // Long streams are split over several threads as well; share
+        // the CPUs between them rather than each taking them all.
+        BZReader* readers[3] = { &s->ctrl, &s->diff, &s->extra };
+        int num_long = 0, i;
+        for (i = 0; i < 3; ++i) {
+            if (readers[i]->stream.avail_in >= PARALLEL_BZ2_MIN_SIZE) {
+                num_long++;
+            }
+        }
+        for (i = 0; i < 3; ++i) {
+            if (readers[i]->stream.avail_in >= PARALLEL_BZ2_MIN_SIZE) {
+                readers[i]->max_threads = max_threads / num_long;
+            }
+            StartDecodeThread(readers[i]);
+        }
+    }
+    return 0;
+}
+
+// Where the new file is produced: "size" bytes of "data", of which
+// "fill" are in use.  Each time the window fills, it is passed to the
+// sink (and the hash) and reused.  With a window as large as the new
+// file and no sink, the whole file is left in the window instead.
+typedef struct {
+    unsigned char* data;
+    ssize_t size;
+    ssize_t fill;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+} OutputWindow;
+
+static int FlushWindow(OutputWindow* w) {
+    if (w->fill == 0 || w->sink == NULL) {
+        return 0;
+    }
+    if (w->sink(w->data, w->fill, w->token) < w->fill) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
+    if (w->ctx) {
+        SHA_update(w->ctx, w->data, w->fill);
+    }
+    w->fill = 0;
+    return 0;
+}
 
+// dst[i] += src[i] for "n" bytes, 16 at a time where the CPU can.
+static void AddBytes(unsigned char* dst, const unsigned char* src, size_t n) {
+    size_t i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i o = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(d, o));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+// Add the old file, from "oldpos" on, to the "len" bytes of diff string
+// at "out".  Bytes of the run that fall outside the old file are left
+// as they are, so the run is clipped to the old file once, up front.
+// (An all-zero diff run needs no special case: the add already copies
+// the old data at memory speed.)
+static void AddOldData(unsigned char* out, off_t len,
+                       const unsigned char* old_data, ssize_t old_size,
+                       off_t oldpos) {
+    off_t start = 0, end = len;
+    if (oldpos < 0) {
+        if (oldpos <= -len) return;
+        start = -oldpos;
+    }
+    if (oldpos >= old_size) return;
+    if (old_size - oldpos < end) end = old_size - oldpos;
+    AddBytes(out + start, old_data + oldpos + start, end - start);
+}
+
+// Append "len" bytes from "stream" to the new file.  If "oldpos" isn't
+// NULL, this is a diff string: the old data starting at *oldpos is added
+// to it, and *oldpos advanced past it.
+static int ReadNewData(OutputWindow* w, BZReader* stream, off_t len,
+                       const unsigned char* old_data, ssize_t old_size,
+                       off_t* oldpos) {
+    while (len > 0) {
+        if (w->fill == w->size && FlushWindow(w) != 0) {
+            return 1;
+        }
+        ssize_t chunk = w->size - w->fill;
+        if (chunk > len) chunk = len;
+
+        unsigned char* out = w->data + w->fill;
+        if (ReadBZStream(stream, out, chunk) != 0) {
+            return 1;
+        }
+        if (oldpos != NULL) {
+            AddOldData(out, chunk, old_data, old_size, *oldpos);
+            *oldpos += chunk;
+        }
+        w->fill += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Run the control tuples of an opened patch, writing the new file to
+// "w".
+static int RunBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                          BSDiffStreams* s, OutputWindow* w) {
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < s->new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ReadBZStream(&s->ctrl, buf, 24) != 0) {
             printf("error while reading control stream\n");
             return 1;
         }
@@ -206,47 +570,228 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            ctrl[0] > s->new_size - newpos ||
+            ctrl[1] > s->new_size - newpos - ctrl[0]) {
             printf("corrupt patch (new file overrun)\n");
             return 1;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
+        // Read diff string, adding old data to it
+        if (ReadNewData(w, &s->diff, ctrl[0],
+                        old_data, old_size, &oldpos) != 0) {
             printf("error while reading diff stream\n");
             return 1;
         }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
-            }
+        // Read extra string
+        if (ReadNewData(w, &s->extra, ctrl[1],
+                        old_data, old_size, NULL) != 0) {
+            printf("error while reading extra stream\n");
+            return 1;
         }
 
         // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
+        newpos += ctrl[0] + ctrl[1];
+        oldpos += ctrl[2];
+    }
 
-        // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
+    return FlushWindow(w);
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    BSDiffStreams s;
+    if (OpenBSDiffPatch(patch, patch_offset, 0, &s) != 0) {
+        return -1;
+    }
+
+    OutputWindow w;
+    w.size = s.new_size < BSDIFF_WINDOW_SIZE ? s.new_size : BSDIFF_WINDOW_SIZE;
+    w.fill = 0;
+    w.sink = sink;
+    w.token = token;
+    w.ctx = ctx;
+    w.data = malloc(w.size > 0 ? w.size : 1);
+    if (w.data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output window\n",
+               (long)w.size);
+        CloseBSDiffPatch(&s);
+        return 1;
+    }
+
+    int result = RunBSDiffPatch(old_data, old_size, &s, &w);
+    free(w.data);
+    CloseBSDiffPatch(&s);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        int max_threads,
+                        unsigned char** new_data, ssize_t* new_size) {
+    BSDiffStreams s;
+    if (OpenBSDiffPatch(patch, patch_offset, max_threads, &s) != 0) {
+        return 1;
+    }
+
+    *new_size = s.new_size;
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        CloseBSDiffPatch(&s);
+        return 1;
+    }
+
+    OutputWindow w;
+    w.data = *new_data;
+    w.size = *new_size;
+    w.fill = 0;
+    w.sink = NULL;
+    w.token = NULL;
+    w.ctx = NULL;
+
+    int result = RunBSDiffPatch(old_data, old_size, &s, &w);
+    CloseBSDiffPatch(&s);
+    if (result != 0) {
+        free(*new_data);
+        *new_data = NULL;
+    }
+    return result;
+}
+
+#ifdef APPLYPATCH_BENCHMARK
+
+// Microbenchmark for AddOldData(): replay the diff runs of a bsdiff
+// patch (their real lengths and old-file offsets, and the real diff
+// bytes) against a synthetic old file, once with the original bytewise
+// loop and once with AddOldData(), and print the times.
+
+// Replay at most this much diff data.
+#define ADD_BENCH_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct {
+    off_t oldpos;
+    off_t len;
+} DiffRun;
+
+static void AddOldDataBytewise(unsigned char* out, off_t len,
+                               const unsigned char* old_data, ssize_t old_size,
+                               off_t oldpos) {
+    off_t i;
+    for (i = 0; i < len; ++i) {
+        if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+            out[i] += old_data[oldpos+i];
         }
+    }
+}
 
-        // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+static double BenchNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int BenchmarkAddOldData(const Value* patch, ssize_t patch_offset) {
+    BSDiffStreams s;
+    if (OpenBSDiffPatch(patch, patch_offset, 0, &s) != 0) {
+        return 1;
+    }
+
+    ssize_t cap = s.new_size < ADD_BENCH_MAX_BYTES ?
+        s.new_size : ADD_BENCH_MAX_BYTES;
+    unsigned char* diff = malloc(cap > 0 ? cap : 1);
+    unsigned char* work = malloc(cap > 0 ? cap : 1);
+    unsigned char* work2 = malloc(cap > 0 ? cap : 1);
+    DiffRun* runs = NULL;
+    int num_runs = 0, alloc_runs = 0;
+    ssize_t diff_len = 0;
+    off_t oldpos = 0, newpos = 0, old_end = 0;
+    int result = 1;
+    int i;
+
+    if (diff == NULL || work == NULL || work2 == NULL) goto done;
+
+    // Collect the diff runs, without the extra strings in between.
+    while (newpos < s.new_size && diff_len < cap) {
+        unsigned char buf[24];
+        off_t ctrl[3];
+        if (ReadBZStream(&s.ctrl, buf, 24) != 0) goto done;
+        ctrl[0] = offtin(buf);
+        ctrl[1] = offtin(buf+8);
+        ctrl[2] = offtin(buf+16);
+        if (ctrl[0] < 0 || ctrl[1] < 0) goto done;
+        if (ctrl[0] > cap - diff_len) ctrl[0] = cap - diff_len;
+        if (ReadBZStream(&s.diff, diff + diff_len, ctrl[0]) != 0) goto done;
+
+        if (num_runs == alloc_runs) {
+            alloc_runs = alloc_runs ? alloc_runs * 2 : 1024;
+            DiffRun* grown = realloc(runs, alloc_runs * sizeof(DiffRun));
+            if (grown == NULL) goto done;
+            runs = grown;
         }
+        runs[num_runs].oldpos = oldpos;
+        runs[num_runs].len = ctrl[0];
+        num_runs++;
+        if (oldpos + ctrl[0] > old_end) old_end = oldpos + ctrl[0];
+
+        diff_len += ctrl[0];
+        newpos += ctrl[0] + ctrl[1];
+        oldpos += ctrl[0] + ctrl[2];
+    }
 
-        // Adjust pointers
-        newpos += ctrl[1];
-        oldpos += ctrl[2];
+    // The old file isn't at hand; its contents don't affect the timing.
+    ssize_t old_size = old_end > 0 ? old_end : 1;
+    unsigned char* old_data = malloc(old_size);
+    if (old_data == NULL) goto done;
+    for (i = 0; i < old_size; ++i) {
+        old_data[i] = i * 131 + (i >> 9);
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
-    return 0;
+    double bytewise_ms = 0, kernel_ms = 0;
+    int pass;
+    for (pass = 0; pass < 3; ++pass) {
+        memcpy(work, diff, diff_len);
+        memcpy(work2, diff, diff_len);
+        unsigned char* p = work;
+        double t0 = BenchNowMs();
+        for (i = 0; i < num_runs; ++i) {
+            AddOldDataBytewise(p, runs[i].len, old_data, old_size,
+                               runs[i].oldpos);
+            p += runs[i].len;
+        }
+        double t1 = BenchNowMs();
+        p = work2;
+        for (i = 0; i < num_runs; ++i) {
+            AddOldData(p, runs[i].len, old_data, old_size, runs[i].oldpos);
+            p += runs[i].len;
+        }
+        double t2 = BenchNowMs();
+        bytewise_ms += t1 - t0;
+        kernel_ms += t2 - t1;
+    }
+    free(old_data);
+
+    if (memcmp(work, work2, diff_len) != 0) {
+        printf("add-old-data: kernel output differs\n");
+        goto done;
+    }
+    printf("add-old-data: %d runs, %ld bytes (mean run %ld): "
+           "bytewise %.1f ms, kernel %.1f ms\n",
+           num_runs, (long)diff_len,
+           num_runs ? (long)(diff_len / num_runs) : 0L,
+           bytewise_ms / 3, kernel_ms / 3);
+    result = 0;
+
+  done:
+    free(runs);
+    free(work2);
+    free(work);
+    free(diff);
+    CloseBSDiffPatch(&s);
+    return result;
 }
+
+#endif  // APPLYPATCH_BENCHMARK
@@ -0,0 +1,550 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Block-parallel bzip2 decompression.
+//
+// A bzip2 stream is a "BZh<level>" header, a series of blocks, and an
+// end-of-stream record; each block starts with the 48-bit magic
+// 0x314159265359 and the block's CRC, and the end-of-stream record is
+// the magic 0x177245385090 and the CRC of the whole stream.  Neither is
+// byte-aligned, but a block doesn't depend on anything before it, so
+// once the magics are found each block can be shifted into a stream of
+// its own and handed to libbz2 on a separate thread.
+//
+// The magics can also turn up by chance inside compressed data.  Such a
+// split (almost always) makes the stream CRC computed from the block
+// CRCs disagree with the stored one, and otherwise makes libbz2 reject
+// the pieces it produces; either way, the stream is decoded serially
+// instead, so a false match costs time but never changes the output.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <bzlib.h>
+
+#include "applypatch.h"
+#include "utils.h"
+
+#define BZ_BLOCK_MAGIC 0x314159265359ULL
+#define BZ_EOS_MAGIC   0x177245385090ULL
+#define BZ_MAGIC_MASK  0xffffffffffffULL
+
+// Don't start more decoding threads than this, and let them run at most
+// this many blocks per thread ahead of the sink.
+#define MAX_BZ_THREADS 8
+#define BZ_BLOCKS_AHEAD 2
+
+// Serial decoding goes through a buffer of this size.
+#define SERIAL_BUFFER_SIZE (256 * 1024)
+
+// A worker decodes at most this much of a block ahead of the sink.  The
+// initial run-length encoding lets a 900 KB block expand to 45 MB; the
+// rest of such a block is decoded as it is emitted.
+#define BLOCK_OUTPUT_SIZE (2 * 1024 * 1024)
+
+// A block found in the stream, and what became of it.
+typedef struct {
+    uint64_t start;          // bit offset of the block magic
+    uint64_t end;            // bit offset of the next magic
+    uint32_t crc;
+    unsigned char* in;       // the block as a stream of its own
+    bz_stream* stream;       // decoding it, until it's all decoded
+    unsigned char* out;      // decoded data, once done
+    size_t out_len;
+    int state;               // BLOCK_*
+} BZBlock;
+
+enum { BLOCK_QUEUED, BLOCK_DONE, BLOCK_FAILED };
+
+typedef struct {
+    const unsigned char* data;
+    int level;               // '1' to '9'
+    BZBlock* blocks;
+    int num_blocks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;     // a block was decoded (or failed)
+    pthread_cond_t room;     // a block was emitted, or abort was set
+    int next_block;          // next to be claimed by a worker
+    int num_emitted;
+    int max_ahead;
+    int abort;
+} BZPool;
+
+// Read the 32 bits at bit offset "bit" of "data".  Only the bytes they
+// span are touched: four if "bit" is on a byte boundary, five if not.
+static uint32_t GetBits32(const unsigned char* data, uint64_t bit) {
+    const unsigned char* p = data + bit / 8;
+    int shift = bit % 8;
+    uint64_t v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                 ((uint32_t)p[2] << 8) | p[3];
+    if (shift == 0) {
+        return (uint32_t)v;
+    }
+    v = (v << 8) | p[4];
+    return (uint32_t)(v >> (8 - shift));
+}
+
+// Write the low "n" bits of "v" (n <= 32) at bit offset "bit" of "buf",
+// which must be zeroed beyond "bit".
+static void PutBits(unsigned char* buf, uint64_t bit, uint32_t v, int n) {
+    while (n > 0) {
+        int room = 8 - bit % 8;
+        int take = n < room ? n : room;
+        unsigned char piece = (v >> (n - take)) & ((1 << take) - 1);
+        buf[bit / 8] |= piece << (room - take);
+        bit += take;
+        n -= take;
+    }
+}
+
+// Find the blocks of the stream of "len" bytes at "data", and the
+// stream CRC that follows them.  Returns the number of blocks, or -1 if
+// the data doesn't look like a bzip2 stream (or the end of the stream
+// wasn't found).
+static int FindBlocks(const unsigned char* data, ssize_t len,
+                      BZBlock** blocks_out, uint32_t* stream_crc) {
+    BZBlock* blocks = NULL;
+    int num_blocks = 0, alloc = 0;
+    uint64_t window = 0;
+    ssize_t i;
+
+    for (i = 4; i < len; ++i) {
+        unsigned int byte = data[i];
+        int b;
+        for (b = 7; b >= 0; --b) {
+            window = (window << 1) | ((byte >> b) & 1);
+            uint64_t magic = window & BZ_MAGIC_MASK;
+            if (magic != BZ_BLOCK_MAGIC && magic != BZ_EOS_MAGIC) {
+                continue;
+            }
+            // A CRC follows each magic; the stream's may end exactly at
+            // the end of the data.
+            uint64_t start = (uint64_t)i * 8 + (7 - b) + 1 - 48;
+            if (start < 32 || (start + 80 + 7) / 8 > (uint64_t)len) {
+                continue;
+            }
+            if (num_blocks > 0) {
+                blocks[num_blocks-1].end = start;
+            } else if (start != 32) {
+                goto fail;      // the first block must follow the header
+            }
+            if (magic == BZ_EOS_MAGIC) {
+                *stream_crc = GetBits32(data, start + 48);
+                *blocks_out = blocks;
+                return num_blocks;
+            }
+            if (num_blocks == alloc) {
+                alloc = alloc ? alloc * 2 : 64;
+                BZBlock* grown = realloc(blocks, alloc * sizeof(BZBlock));
+                if (grown == NULL) goto fail;
+                blocks = grown;
+            }
+            memset(&blocks[num_blocks], 0, sizeof(BZBlock));
+            blocks[num_blocks].start = start;
+            blocks[num_blocks].crc = GetBits32(data, start + 48);
+            num_blocks++;
+        }
+    }
+
+  fail:
+    free(blocks);
+    return -1;
+}
+
+static void EndBlock(BZBlock* block) {
+    if (block->stream != NULL) {
+        BZ2_bzDecompressEnd(block->stream);
+        free(block->stream);
+        block->stream = NULL;
+    }
+    free(block->in);
+    block->in = NULL;
+}
+
+// Decode the next BLOCK_OUTPUT_SIZE bytes (or the rest) of a block into
+// block->out.  Once the block's end is reached, its stream is released.
+static int ContinueBlock(BZBlock* block) {
+    bz_stream* stream = block->stream;
+    int bzerr;
+
+    stream->next_out = (char*)block->out;
+    stream->avail_out = BLOCK_OUTPUT_SIZE;
+    do {
+        unsigned int before = stream->avail_out;
+        bzerr = BZ2_bzDecompress(stream);
+        if (bzerr == BZ_OK && stream->avail_in == 0 &&
+            stream->avail_out == before) {
+            bzerr = BZ_UNEXPECTED_EOF;
+        }
+    } while (bzerr == BZ_OK && stream->avail_out > 0);
+    block->out_len = BLOCK_OUTPUT_SIZE - stream->avail_out;
+
+    if (bzerr == BZ_STREAM_END) {
+        EndBlock(block);
+    } else if (bzerr != BZ_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+// Start decoding one block by making it a stream of its own: the header,
+// the block's bits moved to a byte boundary, and an end-of-stream record
+// whose CRC is the block's.
+static int DecodeBlock(const unsigned char* data, int level, BZBlock* block) {
+    uint64_t nbits = block->end - block->start;
+    size_t in_len = 4 + (nbits + 80 + 7) / 8;
+    unsigned char* in = calloc(in_len, 1);
+    if (in == NULL) return -1;
+    block->in = in;
+
+    memcpy(in, "BZh", 3);
+    in[3] = level;
+    const unsigned char* src = data + block->start / 8;
+    int shift = block->start % 8;
+    size_t nbytes = (nbits + 7) / 8;
+    size_t i;
+    if (shift == 0) {
+        memcpy(in + 4, src, nbytes);
+    } else {
+        for (i = 0; i < nbytes; ++i) {
+            in[4+i] = (src[i] << shift) | (src[i+1] >> (8 - shift));
+        }
+    }
+    // Clear whatever followed the block in its last byte.
+    if (nbits % 8 != 0) {
+        in[4 + nbits/8] &= 0xff << (8 - nbits % 8);
+    }
+    uint64_t bit = 32 + nbits;
+    PutBits(in, bit, (uint32_t)(BZ_EOS_MAGIC >> 24), 24);
+    PutBits(in, bit + 24, (uint32_t)(BZ_EOS_MAGIC & 0xffffff), 24);
+    PutBits(in, bit + 48, block->crc, 32);
+
+    // Most blocks need only half of this; the rest is never touched.
+    block->out = malloc(BLOCK_OUTPUT_SIZE);
+    block->stream = calloc(1, sizeof(bz_stream));
+    if (block->out == NULL || block->stream == NULL) {
+        free(block->stream);
+        block->stream = NULL;
+        return -1;
+    }
+    if (BZ2_bzDecompressInit(block->stream, 0, 0) != BZ_OK) {
+        free(block->stream);
+        block->stream = NULL;
+        return -1;
+    }
+    block->stream->next_in = (char*)in;
+    block->stream->avail_in = in_len;
+    return ContinueBlock(block);
+}
+
+static void* BZWorker(void* cookie) {
+    BZPool* pool = (BZPool*) cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->abort && pool->next_block < pool->num_blocks &&
+               pool->next_block >= pool->num_emitted + pool->max_ahead) {
+            pthread_cond_wait(&pool->room, &pool->lock);
+        }
+        if (pool->abort || pool->next_block >= pool->num_blocks) break;
+        BZBlock* block = &pool->blocks[pool->next_block++];
+        pthread_mutex_unlock(&pool->lock);
+
+        int result = DecodeBlock(pool->data, pool->level, block);
+
+        pthread_mutex_lock(&pool->lock);
+        block->state = (result == 0) ? BLOCK_DONE : BLOCK_FAILED;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Decode the stream with libbz2 alone, dropping the first "skip" bytes
+// of output (those the sink already has).
+static int SerialBZ2Decompress(const unsigned char* data, ssize_t len,
+                               size_t skip, SinkFn sink, void* token) {
+    bz_stream stream;
+    int bzerr;
+    int result = -1;
+
+    unsigned char* buffer = malloc(SERIAL_BUFFER_SIZE);
+    if (buffer == NULL) return -1;
+    memset(&stream, 0, sizeof(stream));
+    if ((bzerr = BZ2_bzDecompressInit(&stream, 0, 0)) != BZ_OK) {
+        printf("failed to bzinit stream (%d)\n", bzerr);
+        free(buffer);
+        return -1;
+    }
+    stream.next_in = (char*)data;
+    stream.avail_in = len;
+
+    do {
+        stream.next_out = (char*)buffer;
+        stream.avail_out = SERIAL_BUFFER_SIZE;
+        bzerr = BZ2_bzDecompress(&stream);
+        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
+            printf("bz error %d decompressing\n", bzerr);
+            goto done;
+        }
+        size_t n = SERIAL_BUFFER_SIZE - stream.avail_out;
+        if (bzerr == BZ_OK && n == 0 && stream.avail_in == 0) {
+            printf("bz stream truncated\n");
+            goto done;
+        }
+        unsigned char* p = buffer;
+        if (skip > 0) {
+            size_t drop = skip < n ? skip : n;
+            p += drop;
+            n -= drop;
+            skip -= drop;
+        }
+        if (n > 0 && sink(p, n, token) != (ssize_t)n) {
+            goto done;
+        }
+    } while (bzerr != BZ_STREAM_END);
+    result = 0;
+
+  done:
+    BZ2_bzDecompressEnd(&stream);
+    free(buffer);
+    return result;
+}
+
+static int NumCpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return n > MAX_BZ_THREADS ? MAX_BZ_THREADS : (int)n;
+}
+
+int ParallelBZ2Decompress(const unsigned char* data, ssize_t len,
+                          int max_threads, SinkFn sink, void* token) {
+    BZBlock* blocks = NULL;
+    uint32_t stored_crc = 0, crc = 0;
+    int num_blocks = -1;
+    int num_threads = NumCpus();
+    int i;
+
+    if (max_threads > 0 && max_threads < num_threads) {
+        num_threads = max_threads;
+    }
+
+    if (len >= 4 && memcmp(data, "BZh", 3) == 0 &&
+        data[3] >= '1' && data[3] <= '9' && num_threads > 1) {
+        num_blocks = FindBlocks(data, len, &blocks, &stored_crc);
+    }
+    for (i = 0; i < num_blocks; ++i) {
+        crc = ((crc << 1) | (crc >> 31)) ^ blocks[i].crc;
+    }
+    if (num_blocks < 2 || crc != stored_crc) {
+        // Nothing to gain, or something's wrong with the blocks found;
+        // let libbz2 sort it out.
+        free(blocks);
+        return SerialBZ2Decompress(data, len, 0, sink, token);
+    }
+
+    BZPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.data = data;
+    pool.level = data[3];
+    pool.blocks = blocks;
+    pool.num_blocks = num_blocks;
+    if (num_threads > num_blocks) num_threads = num_blocks;
+    pool.max_ahead = num_threads * BZ_BLOCKS_AHEAD;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pthread_cond_init(&pool.room, NULL);
+
+    pthread_t threads[MAX_BZ_THREADS];
+    int started = 0;
+    while (started < num_threads &&
+           pthread_create(&threads[started], NULL, BZWorker, &pool) == 0) {
+        started++;
+    }
+
+    // Emit the blocks in order as they come in.
+    int result = 0;
+    int failed = 0;
+    size_t emitted_bytes = 0;
+    for (i = 0; started > 0 && i < num_blocks; ++i) {
+        pthread_mutex_lock(&pool.lock);
+        while (blocks[i].state == BLOCK_QUEUED) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        if (blocks[i].state == BLOCK_FAILED) {
+            failed = 1;
+            break;
+        }
+        // A block that decodes to more than BLOCK_OUTPUT_SIZE is
+        // finished here, a piece at a time.  Its CRC isn't checked until
+        // the end, so if it fails after a piece was emitted, there's no
+        // falling back.
+        while (1) {
+            if (sink(blocks[i].out, blocks[i].out_len, token) !=
+                (ssize_t)blocks[i].out_len) {
+                result = -1;
+                break;
+            }
+            emitted_bytes += blocks[i].out_len;
+            if (blocks[i].stream == NULL) break;
+            if (ContinueBlock(&blocks[i]) != 0) {
+                printf("bz error decompressing block %d\n", i);
+                result = -1;
+                break;
+            }
+        }
+        if (result != 0) break;
+        free(blocks[i].out);
+        blocks[i].out = NULL;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.num_emitted++;
+        pthread_cond_broadcast(&pool.room);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.abort = 1;
+    pthread_cond_broadcast(&pool.room);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool.room);
+    pthread_cond_destroy(&pool.done);
+    pthread_mutex_destroy(&pool.lock);
+    for (i = 0; i < num_blocks; ++i) {
+        EndBlock(&blocks[i]);
+        free(blocks[i].out);
+    }
+    free(blocks);
+
+    if (started == 0 || failed) {
+        // Couldn't start any threads, or a block was split at a false
+        // magic.  Everything emitted so far is good; decode the rest
+        // the slow way.
+        result = SerialBZ2Decompress(data, len, emitted_bytes, sink, token);
+    }
+    return result;
+}
+
+#ifdef APPLYPATCH_BENCHMARK
+
+// Benchmark: decode every bzip2 stream of the bsdiff patches in
+// "patch" (a BSDIFF40 patch, or the bsdiff chunks of an IMGDIFF2 one)
+// with libbz2 and with ParallelBZ2Decompress(), check that they agree,
+// and print the times.
+
+typedef struct {
+    unsigned char* data;
+    ssize_t size;
+    ssize_t pos;
+} BenchSink;
+
+static ssize_t BenchSinkFn(unsigned char* data, ssize_t len, void* token) {
+    BenchSink* s = (BenchSink*) token;
+    if (s->pos + len > s->size) {
+        ssize_t size = s->size ? s->size : 1024 * 1024;
+        while (size < s->pos + len) size *= 2;
+        unsigned char* grown = realloc(s->data, size);
+        if (grown == NULL) return -1;
+        s->data = grown;
+        s->size = size;
+    }
+    memcpy(s->data + s->pos, data, len);
+    s->pos += len;
+    return len;
+}
+
+static double NowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int BenchmarkStream(const unsigned char* data, ssize_t len,
+                           double* serial_ms, double* parallel_ms,
+                           long long* bytes) {
+    BenchSink serial = { NULL, 0, 0 };
+    BenchSink parallel = { NULL, 0, 0 };
+    double t0 = NowMs();
+    int r1 = SerialBZ2Decompress(data, len, 0, BenchSinkFn, &serial);
+    double t1 = NowMs();
+    int r2 = ParallelBZ2Decompress(data, len, 0, BenchSinkFn, &parallel);
+    double t2 = NowMs();
+
+    int result = 0;
+    if (r1 != 0 || r2 != 0 || serial.pos != parallel.pos ||
+        memcmp(serial.data, parallel.data, serial.pos) != 0) {
+        printf("  stream at %p: serial %d, parallel %d: output differs\n",
+               data, r1, r2);
+        result = -1;
+    }
+    *serial_ms += t1 - t0;
+    *parallel_ms += t2 - t1;
+    *bytes += serial.pos;
+    free(serial.data);
+    free(parallel.data);
+    return result;
+}
+
+int BenchmarkBZ2Patch(const Value* patch) {
+    const unsigned char* data = (const unsigned char*) patch->data;
+    double serial_ms = 0, parallel_ms = 0;
+    long long bytes = 0;
+    int streams = 0, result = 0;
+    ssize_t pos;
+
+    // Finding the bsdiff headers by their magic is good enough here;
+    // one that doesn't parse is skipped.
+    for (pos = 0; pos + 32 <= patch->size; ++pos) {
+        if (data[pos] != 'B' || memcmp(data + pos, "BSDIFF40", 8) != 0) {
+            continue;
+        }
+        long long ctrl_len = Read8((void*)(data + pos + 8));
+        long long data_len = Read8((void*)(data + pos + 16));
+        if (ctrl_len < 0 || data_len < 0 ||
+            ctrl_len + data_len > patch->size - pos - 32) {
+            continue;
+        }
+        const unsigned char* c = data + pos + 32;
+        const unsigned char* d = c + ctrl_len;
+        const unsigned char* e = d + data_len;
+        if (BenchmarkStream(c, ctrl_len, &serial_ms, &parallel_ms,
+                            &bytes) != 0 ||
+            BenchmarkStream(d, data_len, &serial_ms, &parallel_ms,
+                            &bytes) != 0 ||
+            BenchmarkStream(e, data + patch->size - e, &serial_ms,
+                            &parallel_ms, &bytes) != 0) {
+            result = 1;
+        }
+        streams += 3;
+    }
+
+    printf("%d bzip2 streams, %lld bytes: libbz2 %.1f ms, "
+           "parallel %.1f ms (threads: %d)\n",
+           streams, bytes, serial_ms, parallel_ms, NumCpus());
+    return result;
+}
+
+#endif  // APPLYPATCH_BENCHMARK
@@ -17,9 +17,12 @@
 // See imgdiff.c in this directory for a description of the patch file
 // format.
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -29,15 +32,79 @@
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx) {
+// CHUNK_DEFLATE chunks (inflate the source, bsdiff it in memory,
+// deflate the result) are independent of each other and are the bulk
+// of the work for images with many of them, so they run on a pool of
+// worker threads.  The calling thread walks the chunks in order,
+// handles the CHUNK_NORMAL and CHUNK_RAW ones itself, and feeds each
+// finished deflate chunk to the sink and SHA context in its turn.
+
+// Most worker threads to use.
+#define MAX_IMG_THREADS 4
+
+// Workers stop picking up deflate chunks once the ones in flight
+// (claimed but not yet written out) would hold more memory than this
+// -- except that one chunk may always be in flight.
+#define IMG_MAX_IN_FLIGHT (32 * 1024 * 1024)
+
+enum { CHUNK_PENDING, CHUNK_RUNNING, CHUNK_DONE, CHUNK_FAILED };
+
+typedef struct {
+    int type;
+
+    // CHUNK_NORMAL and CHUNK_DEFLATE
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE
+    size_t expanded_len;
+    size_t target_len;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+
+    // CHUNK_RAW
+    unsigned char* raw;
+    ssize_t raw_len;
+
+    // CHUNK_DEFLATE output, and the memory charged to it while it's
+    // in flight.
+    int state;
+    unsigned char* out;
+    ssize_t out_len;
+    size_t cost;
+} ImgChunk;
+
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    ImgChunk* chunks;
+    int num_chunks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;      // a chunk finished
+    pthread_cond_t space;     // in-flight memory was released
+    int next;                 // first chunk no worker has looked at
+    size_t in_flight;
+    int stop;
+} ImgPool;
+
+// Add 'n' to '*sum'.  Returns -1 if the total doesn't fit in a size_t.
+static int AddSize(size_t* sum, size_t n) {
+    if (n > SIZE_MAX - *sum) {
+        return -1;
+    }
+    *sum += n;
+    return 0;
+}
+
+// Read the chunk records of the patch into an array.  Returns the
+// number of chunks, or -1 on error.
+static int ReadImageChunks(const Value* patch, ssize_t old_size,
+                           ImgChunk** chunks_out) {
     ssize_t pos = 12;
     char* header = patch->data;
     if (patch->size < 12) {
@@ -54,166 +121,380 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks < 0 || num_chunks > (patch->size - 12) / 4) {
+        printf("bad chunk count %d\n", num_chunks);
+        return -1;
+    }
+    ImgChunk* chunks = calloc(num_chunks > 0 ? num_chunks : 1,
+                              sizeof(ImgChunk));
+    if (chunks == NULL) {
+        printf("failed to allocate %d chunk records\n", num_chunks);
+        return -1;
+    }
 
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        ImgChunk* c = chunks + i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        c->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (c->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            c->src_start = Read8(normal_header);
+            c->src_len = Read8(normal_header+8);
+            c->patch_offset = Read8(normal_header+16);
+        } else if (c->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            c->raw_len = Read4(raw_header);
 
-            if (pos + data_len > patch->size) {
+            if (c->raw_len < 0 || pos + c->raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            c->raw = (unsigned char*)patch->data + pos;
+            pos += c->raw_len;
+        } else if (c->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
+            c->src_start = Read8(deflate_header);
+            c->src_len = Read8(deflate_header+8);
+            c->patch_offset = Read8(deflate_header+16);
+            c->expanded_len = Read8(deflate_header+24);
+            c->target_len = Read8(deflate_header+32);
+            c->level = Read4(deflate_header+40);
+            c->method = Read4(deflate_header+44);
+            c->windowBits = Read4(deflate_header+48);
+            c->memLevel = Read4(deflate_header+52);
+            c->strategy = Read4(deflate_header+56);
+
+            // While in flight the chunk holds its expanded source, the
+            // bsdiff output and the buffer that's deflated into.
+            // deflateBound() without a stream bounds that buffer for any
+            // deflate parameters.
+            if (c->patch_offset > (size_t)patch->size ||
+                (size_t)patch->size - c->patch_offset < 32) {
+                printf("chunk %d bsdiff patch is outside the patch\n", i);
+                goto fail;
             }
+            long long new_size = Read8(patch->data + c->patch_offset + 24);
+            if (new_size < 0 ||
+                (unsigned long long)new_size > (SIZE_MAX - 64) / 2 ||
+                AddSize(&c->cost, c->expanded_len) != 0 ||
+                AddSize(&c->cost, new_size) != 0 ||
+                AddSize(&c->cost, deflateBound(NULL, new_size)) != 0) {
+                printf("chunk %d is too large\n", i);
+                goto fail;
+            }
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, c->type);
+            goto fail;
+        }
+
+        if (c->type != CHUNK_RAW &&
+            (c->src_start > (size_t)old_size ||
+             c->src_len > (size_t)old_size - c->src_start)) {
+            printf("chunk %d source is outside the old file\n", i);
+            goto fail;
+        }
+    }
+
+    *chunks_out = chunks;
+    return num_chunks;
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
+  fail:
+    free(chunks);
+    return -1;
+}
+
+// Inflate the source of deflate chunk 'c', apply its bsdiff patch and
+// deflate the result with the chunk's parameters into c->out.  The
+// bsdiff patch is decoded on up to 'max_threads' threads (see
+// ApplyBSDiffPatchMem()).  Returns 0 on success.
+static int ApplyDeflateChunk(const unsigned char* old_data,
+                             const Value* patch, ImgChunk* c, int index,
+                             int max_threads) {
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    unsigned char* expanded_source = malloc(c->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               (int)c->expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = c->src_len;
+    strm.next_in = (unsigned char*)(old_data + c->src_start);
+    strm.avail_out = c->expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        printf("chunk %d source inflation returned %d\n", index, ret);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly.
+    if (strm.avail_out != 0) {
+        printf("chunk %d source inflation short by %d bytes\n",
+               index, strm.avail_out);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    ret = ApplyBSDiffPatchMem(expanded_source, c->expanded_len,
+                              patch, c->patch_offset, max_threads,
+                              &uncompressed_target_data,
+                              &uncompressed_target_size);
+    free(expanded_source);
+    if (ret != 0) {
+        printf("failed to apply chunk %d bsdiff patch\n", index);
+        return -1;
+    }
+
+    // Now compress the target data, in one go, into a buffer big
+    // enough for any outcome.
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm, c->level, c->method, c->windowBits,
+                       c->memLevel, c->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init chunk %d deflate: %d\n", index, ret);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    uLong bound = deflateBound(&strm, uncompressed_target_size);
+    c->out = malloc(bound);
+    if (c->out == NULL) {
+        printf("failed to allocate %lu bytes for chunk %d output\n",
+               bound, index);
+        deflateEnd(&strm);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    strm.avail_out = bound;
+    strm.next_out = c->out;
+    ret = deflate(&strm, Z_FINISH);
+    c->out_len = strm.total_out;
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+    if (ret != Z_STREAM_END) {
+        printf("chunk %d deflate returned %d\n", index, ret);
+        free(c->out);
+        c->out = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void* ImgWorker(void* cookie) {
+    ImgPool* pool = (ImgPool*)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        // Claim the next deflate chunk, in patch order, once there's
+        // room for it.
+        ImgChunk* c = NULL;
+        int index = 0;
+        while (!pool->stop) {
+            while (pool->next < pool->num_chunks &&
+                   pool->chunks[pool->next].type != CHUNK_DEFLATE) {
+                ++pool->next;
+            }
+            if (pool->next >= pool->num_chunks) break;
+            ImgChunk* n = pool->chunks + pool->next;
+            if (pool->in_flight == 0 ||
+                (pool->in_flight <= IMG_MAX_IN_FLIGHT &&
+                 n->cost <= IMG_MAX_IN_FLIGHT - pool->in_flight)) {
+                c = n;
+                index = pool->next++;
+                c->state = CHUNK_RUNNING;
+                pool->in_flight += c->cost;
+                break;
             }
+            pthread_cond_wait(&pool->space, &pool->lock);
+        }
+        if (c == NULL) break;
+        pthread_mutex_unlock(&pool->lock);
+
+        // The workers already use the CPUs; decoding each chunk's patch
+        // on more threads (and their buffers) would only oversubscribe
+        // them, and hold memory IMG_MAX_IN_FLIGHT doesn't count.
+        int ret = ApplyDeflateChunk(pool->old_data, pool->patch, c, index, 1);
+
+        pthread_mutex_lock(&pool->lock);
+        // Only the deflated output stays around until it's written.
+        size_t held = ret == 0 ? (size_t)c->out_len : 0;
+        pool->in_flight -= c->cost - held;
+        c->cost = held;
+        c->state = ret == 0 ? CHUNK_DONE : CHUNK_FAILED;
+        pthread_cond_broadcast(&pool->done);
+        pthread_cond_broadcast(&pool->space);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx) {
+    ImgChunk* chunks;
+    int num_chunks = ReadImageChunks(patch, old_size, &chunks);
+    if (num_chunks < 0) {
+        return -1;
+    }
+
+    int num_deflate = 0;
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type == CHUNK_DEFLATE) ++num_deflate;
+    }
+
+    // With one CPU, or one deflate chunk, there's nothing to overlap;
+    // the deflate chunks are then done here as they come up.
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = ncpu < MAX_IMG_THREADS ? (int)ncpu : MAX_IMG_THREADS;
+    if (num_threads > num_deflate) num_threads = num_deflate;
+    if (num_threads < 2) num_threads = 0;
+
+    ImgPool pool;
+    pthread_t threads[MAX_IMG_THREADS];
+    int started = 0;
+    pool.old_data = old_data;
+    pool.patch = patch;
+    pool.chunks = chunks;
+    pool.num_chunks = num_chunks;
+    pool.next = 0;
+    pool.in_flight = 0;
+    pool.stop = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pthread_cond_init(&pool.space, NULL);
+    while (started < num_threads) {
+        if (pthread_create(&threads[started], NULL, ImgWorker, &pool) != 0) {
+            break;
+        }
+        ++started;
+    }
+
+    int result = -1;
+    for (i = 0; i < num_chunks; ++i) {
+        ImgChunk* c = chunks + i;
+
+        if (c->type == CHUNK_NORMAL) {
+            if (ApplyBSDiffPatch(old_data + c->src_start, c->src_len,
+                                 patch, c->patch_offset,
+                                 sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d bsdiff patch\n", i);
+                goto done;
             }
-            // We should have filled the output buffer exactly.
-            if (strm.avail_out != 0) {
-                printf("source inflation short by %d bytes\n", strm.avail_out);
-                return -1;
+        } else if (c->type == CHUNK_RAW) {
+            SHA_update(ctx, c->raw, c->raw_len);
+            if (sink(c->raw, c->raw_len, token) != c->raw_len) {
+                printf("failed to write chunk %d raw data\n", i);
+                goto done;
             }
-            inflateEnd(&strm);
-
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
+        } else if (started > 0) {
+            pthread_mutex_lock(&pool.lock);
+            while (c->state != CHUNK_DONE && c->state != CHUNK_FAILED) {
+                pthread_cond_wait(&pool.done, &pool.lock);
             }
+            pthread_mutex_unlock(&pool.lock);
+            if (c->state == CHUNK_FAILED) {
+                goto done;
+            }
+        } else if (ApplyDeflateChunk(old_data, patch, c, i, 0) != 0) {
+            goto done;
+        }
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+        if (c->type == CHUNK_DEFLATE) {
+            if (sink(c->out, c->out_len, token) != c->out_len) {
+                printf("failed to write %ld compressed bytes to output\n",
+                       (long)c->out_len);
+                goto done;
             }
+            SHA_update(ctx, c->out, c->out_len);
+            free(c->out);
+            c->out = NULL;
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            if (started > 0) {
+                pthread_mutex_lock(&pool.lock);
+                pool.in_flight -= c->cost;
+                c->cost = 0;
+                pthread_cond_broadcast(&pool.space);
+                pthread_mutex_unlock(&pool.lock);
+            }
         }
     }
+    result = 0;
 
-    return 0;
+  done:
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.space);
+    pthread_mutex_unlock(&pool.lock);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+    pthread_cond_destroy(&pool.space);
+    pthread_cond_destroy(&pool.done);
+    pthread_mutex_destroy(&pool.lock);
+
+    for (i = 0; i < num_chunks; ++i) {
+        free(chunks[i].out);
+    }
+    free(chunks);
+    return result;
 }
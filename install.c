@@ -40,6 +40,10 @@
 
 #define SIDELOADER_BINARY_NAME      "/sbin/sideloader"
 
+// Where the parsed package directory is saved for the updater (and the
+// next install of the same package).  Keep in sync with updater.c.
+#define PACKAGE_INDEX_FILE          "/cache/recovery/package.idx"
+
 static const char *SIDELOAD_TEMP_DIR = "/install";
 static const char *EXTERNAL_SDCARD_ROOT = "/mnt/external_sdcard";
 
@@ -459,7 +463,7 @@ static int really_install_package(const char *path, int* wipe_cache)
 	ZipArchive zip;
 	int err;
 	
-	err = mzOpenZipArchive(path, &zip);
+	err = mzOpenZipArchiveIndexed(path, PACKAGE_INDEX_FILE, true, &zip);
 	if (err != 0) 
 	{
 		LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
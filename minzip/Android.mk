@@ -2,6 +2,7 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	Crc32.c \
 	Hash.c \
 	SysUtil.c \
 	DirUtil.c \
@@ -16,4 +17,98 @@ LOCAL_MODULE := libminzip
 
 LOCAL_CFLAGS += -Wall
 
+# Checksum with the ARMv8 CRC32 instructions; only for CPUs that have them.
+ifeq ($(MINZIP_ARMV8_CRC32),true)
+LOCAL_CFLAGS += -march=armv8-a+crc
+endif
+
+# Inflate whole mapped entries with libdeflate instead of zlib.  Binaries
+# linking libminzip must then link libdeflate too.
+ifeq ($(MINZIP_USE_LIBDEFLATE),true)
+LOCAL_CFLAGS += -DMINZIP_USE_LIBDEFLATE
+LOCAL_C_INCLUDES += external/libdeflate
+endif
+
+# Accept zstd (method 93) and LZ4 frame (method 0x4c34) entries.  Binaries
+# linking libminzip must then link libzstd / liblz4 too.
+ifeq ($(MINZIP_HAVE_ZSTD),true)
+LOCAL_CFLAGS += -DMINZIP_HAVE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+endif
+ifeq ($(MINZIP_HAVE_LZ4),true)
+LOCAL_CFLAGS += -DMINZIP_HAVE_LZ4
+LOCAL_C_INCLUDES += external/lz4/lib
+endif
+
+# Build the mzDump*Stats() benchmarks, for eng builds that want them.
+ifeq ($(MINZIP_BENCHMARK),true)
+LOCAL_CFLAGS += -DMINZIP_BENCHMARK
+endif
+
 include $(BUILD_STATIC_LIBRARY)
+
+# Host tests; run them with test/run_tests.sh.
+minzip_test_src_files := \
+	Crc32.c \
+	Hash.c \
+	SysUtil.c \
+	DirUtil.c \
+	Inlines.c \
+	Zip.c
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(minzip_test_src_files) test/ThreadTest.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	external/zlib \
+	external/safe-iop/include
+LOCAL_MODULE := minzip_thread_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -Wall
+LOCAL_STATIC_LIBRARIES := libz
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(minzip_test_src_files) test/CodecTest.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	external/zlib \
+	external/safe-iop/include
+LOCAL_MODULE := minzip_codec_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -Wall
+LOCAL_STATIC_LIBRARIES := libz
+LOCAL_LDLIBS += -lpthread
+
+# The zstd and LZ4 entries are expected to extract only when built in.
+ifeq ($(MINZIP_HAVE_ZSTD),true)
+LOCAL_CFLAGS += -DMINZIP_HAVE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+ifeq ($(MINZIP_HAVE_LZ4),true)
+LOCAL_CFLAGS += -DMINZIP_HAVE_LZ4
+LOCAL_C_INCLUDES += external/lz4/lib
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(minzip_test_src_files) test/ExtractBench.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	external/zlib \
+	external/safe-iop/include
+LOCAL_MODULE := minzip_extract_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -Wall -DMINZIP_BENCHMARK
+LOCAL_STATIC_LIBRARIES := libz
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * CRC-32 with hardware assistance.
+ *
+ * ARMv8 has CRC32 instructions for exactly this polynomial; they are
+ * used when the compiler targets them (-march=armv8-a+crc).  On x86 we
+ * fold the buffer with PCLMULQDQ, as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction", if
+ * the CPU has it.  Everything else, and short buffers, go to zlib.
+ */
+#include "zlib.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Crc32.h"
+
+#if !defined(__ARM_FEATURE_CRC32)
+/*
+ * zlib's crc32() over "len" bytes.  It takes a uInt length, so longer
+ * buffers (entries of 4GB or more) go in pieces.
+ */
+static unsigned long zlibCrc32(unsigned long crc, const unsigned char* buf,
+    size_t len)
+{
+    while (len > 0) {
+        uInt chunk = len > 0x40000000 ? 0x40000000 : (uInt) len;
+        crc = crc32(crc, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    return crc;
+}
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+/*
+ * Eight bytes per instruction once "buf" is aligned.  Takes and returns
+ * the CRC in its inverted (raw register) form.
+ */
+static uint32_t crc32Armv8(uint32_t crc, const unsigned char* buf,
+    size_t len)
+{
+    while (len > 0 && ((uintptr_t) buf & 7) != 0) {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+    return crc;
+}
+
+unsigned long mzCrc32(unsigned long crc, const unsigned char* buf,
+    size_t len)
+{
+    return ~crc32Armv8(~(uint32_t) crc, buf, len);
+}
+
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+/* below this, the setup and final reduction cost more than they save */
+#define PCLMUL_MIN_LEN 64
+
+/*
+ * Fold "len" bytes (a multiple of 16, at least 64) into the CRC, four
+ * 128-bit lanes at a time, then reduce to 32 bits.  Takes and returns
+ * the CRC in its inverted (raw register) form.
+ *
+ * The constants are x^(4*128+32) mod P, x^(4*128-32) mod P (k1, k2),
+ * the same for one lane (k3, k4), x^64 mod P (k5), and P and its
+ * Barrett constant, all bit-reflected, for P = 0x104c11db7.
+ */
+__attribute__((target("sse2,pclmul")))
+static uint32_t crc32Pclmul(uint32_t crc, const unsigned char* buf,
+    size_t len)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+            { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+            { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+            { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t poly[2] __attribute__((aligned(16))) =
+            { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*) k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* Fold 64 bytes at a time into the four lanes.
+     */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    /* Fold the four lanes into one.
+     */
+    x0 = _mm_load_si128((const __m128i*) k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* Then whatever 16-byte blocks are left.
+     */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*) buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64.
+     */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits.
+     */
+    x0 = _mm_load_si128((const __m128i*) poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+static pthread_once_t gCpuCheckOnce = PTHREAD_ONCE_INIT;
+static int gHavePclmul;
+
+static void checkCpu(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        gHavePclmul = (ecx & bit_PCLMUL) != 0 && (edx & bit_SSE2) != 0;
+}
+
+unsigned long mzCrc32(unsigned long crc, const unsigned char* buf,
+    size_t len)
+{
+    pthread_once(&gCpuCheckOnce, checkCpu);
+    if (gHavePclmul && len >= PCLMUL_MIN_LEN) {
+        size_t chunk = len & ~(size_t) 15;
+
+        crc = ~crc32Pclmul(~(uint32_t) crc, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    return zlibCrc32(crc, buf, len);
+}
+
+#else
+
+unsigned long mzCrc32(unsigned long crc, const unsigned char* buf,
+    size_t len)
+{
+    return zlibCrc32(crc, buf, len);
+}
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * CRC-32, using the CPU's CRC or carry-less multiply instructions when
+ * it has them.
+ */
+#ifndef _MINZIP_CRC32
+#define _MINZIP_CRC32
+
+#include <stddef.h>
+
+/*
+ * Update a running CRC-32 (the Zip / zlib polynomial) with "len" bytes
+ * at "buf".  Start with a "crc" of 0.  Same results as zlib's crc32().
+ */
+unsigned long mzCrc32(unsigned long crc, const unsigned char* buf,
+    size_t len);
+
+#endif /*_MINZIP_CRC32*/
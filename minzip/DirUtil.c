@@ -22,7 +22,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
 
@@ -165,116 +167,461 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
-int
-dirUnlinkHierarchy(const char *path)
+/* One directory being read by walkTree().
+ */
+typedef struct {
+    DIR *dir;
+    char *name;     /* in the directory below it on the stack */
+} DirWalkFrame;
+
+/* Open <name> in <dirFd> for reading, without following a symlink.
+ */
+static DIR *
+openDirAt(int dirFd, const char *name)
 {
-    struct stat st;
     DIR *dir;
-    struct dirent *de;
-    int fail = 0;
+    int fd;
 
-    /* is it a file or directory? */
-    if (lstat(path, &st) < 0) {
+    fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        return NULL;
+    }
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        int save = errno;
+        close(fd);
+        errno = save;
+    }
+    return dir;
+}
+
+/* Find the S_IFMT bits of <de>.  Most filesystems put them in d_type
+ * (as DT_*, which are the same bits shifted down), so there's nothing
+ * to look up; the rest need an fstatat().
+ */
+static int
+getDirentType(int dirFd, const struct dirent *de, mode_t *type)
+{
+    struct stat st;
+
+    if (de->d_type != DT_UNKNOWN) {
+        *type = (mode_t)de->d_type << 12;
+        return 0;
+    }
+    if (fstatat(dirFd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
         return -1;
     }
+    *type = st.st_mode & S_IFMT;
+    return 0;
+}
+
+static bool
+isDotOrDotDot(const char *name)
+{
+    return name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/* Call <fn> on everything under the directory <top> in <topFd>, which
+ * it's already been called on, and then (if <postOrder>) on <top> again.
+ */
+static int
+walkTree(int topFd, const char *top, DirWalkFunction fn, void *cookie,
+        bool postOrder)
+{
+    DirWalkFrame *stack = NULL;
+    size_t depth = 0, stackAlloc = 0;
+    const char *name = top;
+    int dirFd = topFd;
+    int result = -1;
+    int save;
+
+    for (;;) {
+        /* Descend into <name> in <dirFd>.
+         */
+        if (depth == stackAlloc) {
+            size_t newAlloc = stackAlloc ? stackAlloc * 2 : 16;
+            DirWalkFrame *newStack = (DirWalkFrame *)realloc(stack,
+                    newAlloc * sizeof(DirWalkFrame));
+            if (newStack == NULL) {
+                errno = ENOMEM;
+                goto bail;
+            }
+            stack = newStack;
+            stackAlloc = newAlloc;
+        }
+        stack[depth].dir = NULL;
+        stack[depth].name = strdup(name);
+        if (stack[depth].name == NULL) {
+            errno = ENOMEM;
+            goto bail;
+        }
+        depth++;
+        stack[depth - 1].dir = openDirAt(dirFd, name);
+        if (stack[depth - 1].dir == NULL) {
+            goto bail;
+        }
+
+        /* Read until we find a directory to descend into, coming back
+         * up as each one runs out.
+         */
+        name = NULL;
+        while (name == NULL && depth > 0) {
+            DirWalkFrame *cur = &stack[depth - 1];
+            struct dirent *de;
+            mode_t type;
 
-    /* a file, so unlink it */
+            errno = 0;
+            de = readdir(cur->dir);
+            if (de == NULL) {
+                if (errno != 0) {
+                    goto bail;
+                }
+                closedir(cur->dir);
+                cur->dir = NULL;
+                depth--;
+                if (postOrder && fn(depth > 0 ?
+                        dirfd(stack[depth - 1].dir) : topFd,
+                        cur->name, S_IFDIR, true, cookie) < 0) {
+                    free(cur->name);
+                    goto bail;
+                }
+                free(cur->name);
+                continue;
+            }
+            if (isDotOrDotDot(de->d_name)) {
+                continue;
+            }
+            dirFd = dirfd(cur->dir);
+            if (getDirentType(dirFd, de, &type) < 0 ||
+                    fn(dirFd, de->d_name, type, false, cookie) < 0) {
+                goto bail;
+            }
+            if (S_ISDIR(type)) {
+                name = de->d_name;
+            }
+        }
+        if (depth == 0) {
+            break;
+        }
+    }
+    result = 0;
+
+bail:
+    save = errno;
+    while (depth > 0) {
+        depth--;
+        if (stack[depth].dir != NULL) {
+            closedir(stack[depth].dir);
+        }
+        free(stack[depth].name);
+    }
+    free(stack);
+    errno = save;
+    return result;
+}
+
+int
+dirWalkHierarchy(const char *path, DirWalkFunction fn, void *cookie)
+{
+    struct stat st;
+
+    if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        return -1;
+    }
+    if (fn(AT_FDCWD, path, st.st_mode & S_IFMT, false, cookie) < 0) {
+        return -1;
+    }
     if (!S_ISDIR(st.st_mode)) {
-        return unlink(path);
+        return 0;
     }
+    return walkTree(AT_FDCWD, path, fn, cookie, true);
+}
+
+/* State shared by the dirWalkHierarchyParallel() workers.  Directories
+ * still to be read are queued as paths relative to the top; workers
+ * take the most recently queued one under <lock>, so the walk stays
+ * roughly depth first and the queue short.
+ */
+typedef struct {
+    int rootFd;
+    DirWalkFunction fn;
+    void *cookie;
+    char **queue;
+    size_t numQueued;
+    size_t queueAlloc;
+    unsigned int busy;      /* workers reading a directory */
+    int error;              /* errno of the first failure, or 0 */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DirWalkPool;
+
+#define MAX_WALK_THREADS 8
+
+/* Directories deeper than this (as a path from the top) aren't queued;
+ * the worker that finds one walks it itself, by fd.
+ */
+#define MAX_QUEUED_PATH 1024
+
+static bool
+queueWalkDir(DirWalkPool *pool, char *relPath)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->numQueued == pool->queueAlloc) {
+        size_t newAlloc = pool->queueAlloc ? pool->queueAlloc * 2 : 64;
+        char **newQueue = (char **)realloc(pool->queue,
+                newAlloc * sizeof(char *));
+        if (newQueue == NULL) {
+            ok = false;
+        } else {
+            pool->queue = newQueue;
+            pool->queueAlloc = newAlloc;
+        }
+    }
+    if (ok) {
+        pool->queue[pool->numQueued++] = relPath;
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+/* Read the directory at <relPath> under the top, passing everything in
+ * it to the walk function and queueing its subdirectories.
+ */
+static int
+walkOneDir(DirWalkPool *pool, const char *relPath)
+{
+    size_t relLen = strlen(relPath);
+    struct dirent *de;
+    DIR *dir;
+    int result = 0;
 
-    /* a directory, so open handle */
-    dir = opendir(path);
+    dir = openDirAt(pool->rootFd, relPath);
     if (dir == NULL) {
         return -1;
     }
+    for (;;) {
+        mode_t type;
 
-    /* recurse over components */
-    errno = 0;
-    while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
-        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+        errno = 0;
+        de = readdir(dir);
+        if (de == NULL) {
+            if (errno != 0) {
+                result = -1;
+            }
+            break;
+        }
+        if (isDotOrDotDot(de->d_name)) {
             continue;
         }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
+        if (getDirentType(dirfd(dir), de, &type) < 0 ||
+                pool->fn(dirfd(dir), de->d_name, type, false,
+                        pool->cookie) < 0) {
+            result = -1;
             break;
         }
-        errno = 0;
-    }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
-        return -1;
+        if (S_ISDIR(type)) {
+            size_t nameLen = strlen(de->d_name);
+            if (relLen + 1 + nameLen >= MAX_QUEUED_PATH) {
+                if (walkTree(dirfd(dir), de->d_name, pool->fn, pool->cookie,
+                        false) < 0) {
+                    result = -1;
+                    break;
+                }
+                continue;
+            }
+            char *childPath = (char *)malloc(relLen + 1 + nameLen + 1);
+            if (childPath == NULL) {
+                errno = ENOMEM;
+                result = -1;
+                break;
+            }
+            memcpy(childPath, relPath, relLen);
+            childPath[relLen] = '/';
+            memcpy(childPath + relLen + 1, de->d_name, nameLen + 1);
+            if (!queueWalkDir(pool, childPath)) {
+                free(childPath);
+                errno = ENOMEM;
+                result = -1;
+                break;
+            }
+        }
     }
+    int save = errno;
+    closedir(dir);
+    errno = save;
+    return result;
+}
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        return -1;
-    }
+static void *
+walkWorker(void *arg)
+{
+    DirWalkPool *pool = (DirWalkPool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        /* Wait for a directory, or for the walk to end: nothing queued
+         * and nobody reading a directory that might queue more.
+         */
+        while (pool->error == 0 && pool->numQueued == 0 && pool->busy > 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->error != 0 || pool->numQueued == 0) {
+            break;
+        }
+        char *relPath = pool->queue[--pool->numQueued];
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        int err = walkOneDir(pool, relPath) < 0 ? (errno ? errno : EIO) : 0;
+        free(relPath);
 
-    /* delete target directory */
-    return rmdir(path);
+        pthread_mutex_lock(&pool->lock);
+        pool->busy--;
+        if (err != 0 && pool->error == 0) {
+            pool->error = err;
+        }
+        if (pool->busy == 0 || err != 0) {
+            pthread_cond_broadcast(&pool->cond);
+        }
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
 int
-dirSetHierarchyPermissions(const char *path,
-        int uid, int gid, int dirMode, int fileMode)
+dirWalkHierarchyParallel(const char *path, DirWalkFunction fn,
+        void *cookie, int maxThreads)
 {
+    pthread_t threads[MAX_WALK_THREADS];
+    DirWalkPool pool;
     struct stat st;
-    if (lstat(path, &st)) {
+    char *top;
+    long numThreads;
+    int i, started;
+
+    if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
         return -1;
     }
-
-    /* ignore symlinks */
-    if (S_ISLNK(st.st_mode)) {
+    if (fn(AT_FDCWD, path, st.st_mode & S_IFMT, false, cookie) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
         return 0;
     }
 
-    /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    memset(&pool, 0, sizeof(pool));
+    pool.fn = fn;
+    pool.cookie = cookie;
+    pool.rootFd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (pool.rootFd < 0) {
         return -1;
     }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    top = strdup(".");
+    if (top == NULL || !queueWalkDir(&pool, top)) {
+        free(top);
+        pool.error = ENOMEM;
+        goto done;
+    }
 
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            return -1;
+    if (maxThreads > MAX_WALK_THREADS) {
+        maxThreads = MAX_WALK_THREADS;
+    }
+    numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > maxThreads) {
+        numThreads = maxThreads;
+    }
+
+    /* The calling thread is a worker too.  If we can't start a thread,
+     * just carry on with the ones we have.
+     */
+    started = 0;
+    for (i = 1; i < numThreads; i++) {
+        if (pthread_create(&threads[started], NULL, walkWorker, &pool) != 0) {
+            break;
         }
+        started++;
+    }
+    walkWorker(&pool);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-        errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-                continue;
-            }
+done:
+    /* Anything left over was queued after a failure.
+     */
+    while (pool.numQueued > 0) {
+        free(pool.queue[--pool.numQueued]);
+    }
+    free(pool.queue);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    close(pool.rootFd);
+    if (pool.error != 0) {
+        errno = pool.error;
+        return -1;
+    }
+    return 0;
+}
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
-            }
-        }
+static int
+unlinkWalkFunction(int dirFd, const char *name, mode_t type, bool postOrder,
+        void *cookie)
+{
+    (void)cookie;
+    if (!S_ISDIR(type)) {
+        return unlinkat(dirFd, name, 0);
+    }
+    return postOrder ? unlinkat(dirFd, name, AT_REMOVEDIR) : 0;
+}
 
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
-        }
+int
+dirUnlinkHierarchy(const char *path)
+{
+    return dirWalkHierarchy(path, unlinkWalkFunction, NULL);
+}
 
-        if (closedir(dir)) {
-            return -1;
-        }
+typedef struct {
+    int uid;
+    int gid;
+    int dirMode;
+    int fileMode;
+} PermsCookie;
+
+static int
+permsWalkFunction(int dirFd, const char *name, mode_t type, bool postOrder,
+        void *cookie)
+{
+    const PermsCookie *perms = (const PermsCookie *)cookie;
+
+    /* ignore symlinks */
+    if (postOrder || S_ISLNK(type)) {
+        return 0;
     }
 
+    /* directories and files get different permissions */
+    if (fchownat(dirFd, name, perms->uid, perms->gid, AT_SYMLINK_NOFOLLOW) ||
+        fchmodat(dirFd, name,
+                S_ISDIR(type) ? perms->dirMode : perms->fileMode, 0)) {
+        return -1;
+    }
     return 0;
 }
+
+int
+dirSetHierarchyPermissions(const char *path,
+        int uid, int gid, int dirMode, int fileMode)
+{
+    PermsCookie perms = { uid, gid, dirMode, fileMode };
+
+    return dirWalkHierarchyParallel(path, permsWalkFunction, &perms,
+            MAX_WALK_THREADS);
+}
@@ -18,6 +18,7 @@
 #define MINZIP_DIRUTIL_H_
 
 #include <stdbool.h>
+#include <sys/types.h>
 #include <utime.h>
 
 /* Like "mkdir -p", try to guarantee that all directories
@@ -36,6 +37,35 @@
 int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName);
 
+/* What dirWalkHierarchy() calls for each thing in the hierarchy.  The
+ * thing is <name> in the directory open as <dirFd> (for the top, the
+ * path given in AT_FDCWD), ready for the *at() calls, and <type> is its
+ * S_IFMT bits.  Directories are passed once before their contents, with
+ * <postOrder> false, and once after, with it true.
+ *
+ * Return 0 to carry on, or -1 (with errno set) to stop the walk.
+ */
+typedef int (*DirWalkFunction)(int dirFd, const char *name, mode_t type,
+        bool postOrder, void *cookie);
+
+/* Call <fn> on <path> and, if it's a directory, everything under it,
+ * depth first.  Directories are read through fds, never by path, and
+ * the walk keeps its own stack rather than recursing.  Symlinks are
+ * passed to <fn> but not followed.
+ *
+ * Returns 0 on success; returns -1 (and sets errno) if <fn> or the walk
+ * fails, after stopping the walk.
+ */
+int dirWalkHierarchy(const char *path, DirWalkFunction fn, void *cookie);
+
+/* Like dirWalkHierarchy(), but up to <maxThreads> threads read different
+ * directories at once, so <fn> must be thread-safe.  All that's promised
+ * about order is that a directory is passed to <fn> before anything in
+ * it; there are no <postOrder> calls.
+ */
+int dirWalkHierarchyParallel(const char *path, DirWalkFunction fn,
+        void *cookie, int maxThreads);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
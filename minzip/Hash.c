@@ -7,6 +7,7 @@
  */
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 
 #define LOG_TAG "minzip"
 #include "Log.h"
@@ -351,17 +352,23 @@ int countProbes(HashTable* pHashTable, unsigned int itemHash, const void* item,
 }
 
 /*
- * Evaluate the amount of probing required for the specified hash table.
+ * Evaluate the amount of probing required for the specified hash table,
+ * and how long a lookup takes.
  *
  * We do this by running through all entries in the hash table, computing
- * the hash value and then doing a lookup.
+ * the hash value and then doing a lookup.  The lookups are then repeated
+ * PROBE_TIMING_PASSES times against the clock.
  *
  * The caller should lock the table before calling here.
  */
+#define PROBE_TIMING_PASSES 4
+
 void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
     HashCompareFunc cmpFunc)
 {
-    int numEntries, minProbe, maxProbe, totalProbe;
+    int numEntries, minProbe, maxProbe, totalProbe, pass;
+    struct timespec start, end;
+    long long elapsedNs;
     HashIter iter;
 
     numEntries = maxProbe = totalProbe = 0;
@@ -384,7 +391,26 @@ void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
         totalProbe += count;
     }
 
-    LOGI("Probe: min=%d max=%d, total=%d in %d (%d), avg=%.3f\n",
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (pass = 0; pass < PROBE_TIMING_PASSES; pass++) {
+        for (mzHashIterBegin(pHashTable, &iter); !mzHashIterDone(&iter);
+            mzHashIterNext(&iter))
+        {
+            const void* data = (const void*)mzHashIterData(&iter);
+
+            if (mzHashTableLookup(pHashTable, (*calcFunc)(data), (void*) data,
+                    cmpFunc, false) != data)
+            {
+                LOGW("Probe: lookup found the wrong entry\n");
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsedNs = (end.tv_sec - start.tv_sec) * 1000000000LL +
+            (end.tv_nsec - start.tv_nsec);
+
+    LOGI("Probe: min=%d max=%d, total=%d in %d (%d), avg=%.3f, %.1f ns/lookup\n",
         minProbe, maxProbe, totalProbe, numEntries, pHashTable->tableSize,
-        (float) totalProbe / (float) numEntries);
+        (float) totalProbe / (float) numEntries,
+        numEntries ? (double) elapsedNs / numEntries / PROBE_TIMING_PASSES : 0.0);
 }
@@ -3,6 +3,7 @@
  *
  * System utilities.
  */
+#define _LARGEFILE64_SOURCE     // for lseek64() on glibc hosts
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -11,6 +12,10 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
 
 #define LOG_TAG "minzip"
 #include "Log.h"
@@ -46,21 +51,31 @@ static void* sysCreateAnonShmem(size_t length)
 
 static int getFileStartAndLength(int fd, off_t *start_, size_t *length_)
 {
-    off_t start, end;
+    off64_t start, end;
     size_t length;
 
     assert(start_ != NULL);
     assert(length_ != NULL);
 
-    start = lseek(fd, 0L, SEEK_CUR);
-    end = lseek(fd, 0L, SEEK_END);
-    (void) lseek(fd, start, SEEK_SET);
+    /* Use the 64-bit calls so a >2GB package on a 32-bit build fails
+     * below with a useful message instead of EOVERFLOW.
+     */
+    start = lseek64(fd, 0L, SEEK_CUR);
+    end = lseek64(fd, 0L, SEEK_END);
+    (void) lseek64(fd, start, SEEK_SET);
 
-    if (start == (off_t) -1 || end == (off_t) -1) {
+    if (start == (off64_t) -1 || end == (off64_t) -1) {
         LOGE("could not determine length of file\n");
         return -1;
     }
 
+    if (start != (off_t) start ||
+            (unsigned long long) (end - start) > SIZE_MAX) {
+        LOGE("file is too large to map (%lld bytes)\n",
+            (long long) (end - start));
+        return -1;
+    }
+
     length = end - start;
     if (length == 0) {
         LOGE("file is empty\n");
@@ -192,6 +207,110 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     return 0;
 }
 
+/*
+ * Pass madvise() advice for part of a mapping.
+ */
+void sysAdviseMapRange(const MemMapping* pMap, size_t offset, size_t length,
+    int advice)
+{
+    uintptr_t start, end, base, baseEnd;
+
+    if (pMap->addr == NULL || offset >= pMap->length)
+        return;
+    if (length > pMap->length - offset)
+        length = pMap->length - offset;
+
+    base = (uintptr_t) pMap->baseAddr;
+    baseEnd = base + pMap->baseLength;
+    start = (uintptr_t) pMap->addr + offset;
+    end = start + length;
+    start -= (start - base) % DEFAULT_PAGE_SIZE;
+    end += (DEFAULT_PAGE_SIZE - (end - base) % DEFAULT_PAGE_SIZE) %
+            DEFAULT_PAGE_SIZE;
+    if (end > baseEnd)
+        end = baseEnd;
+
+    if (madvise((void*) start, end - start, advice) < 0) {
+        LOGV("madvise(%p, %zu, %d) failed: %s\n", (void*) start,
+            (size_t) (end - start), advice, strerror(errno));
+    }
+}
+
+/*
+ * fallocate(2).  Older bionic has no fallocate64() (or fallocate()), so
+ * go straight to the kernel.  On 32-bit ABIs each 64-bit argument goes
+ * as two words, low word first; after "fd" and "mode" they land in the
+ * aligned register pairs the kernel expects.
+ */
+int sysFallocate(int fd, int mode, long long offset, long long length)
+{
+#ifdef __NR_fallocate
+    if (sizeof(long) < sizeof(long long)) {
+        return syscall(__NR_fallocate, fd, mode,
+            (long) offset, (long) (offset >> 32),
+            (long) length, (long) (length >> 32));
+    }
+    return syscall(__NR_fallocate, fd, mode, (long) offset, (long) length);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * Reserve space for data about to be written.
+ */
+void sysPreallocateFile(int fd, long long length)
+{
+    long long start;
+
+    if (length <= 0)
+        return;
+    start = lseek64(fd, 0, SEEK_CUR);
+    if (start < 0)
+        return;
+    if (sysFallocate(fd, FALLOC_FL_KEEP_SIZE, start, length) != 0 &&
+            errno != EOPNOTSUPP && errno != ENOSYS && errno != ENODEV) {
+        LOGV("fallocate(%d, %lld, %lld) failed: %s\n", fd, start, length,
+            strerror(errno));
+    }
+}
+
+/*
+ * Flush one filesystem to stable storage.
+ */
+int sysSyncFilesystem(const char* path)
+{
+    int fd, result;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open \"%s\" to sync it: %s\n", path, strerror(errno));
+        return -1;
+    }
+#ifdef __NR_syncfs
+    /* bionic may not wrap it, so go straight to the kernel */
+    result = syscall(__NR_syncfs, fd);
+    if (result != 0 && errno == ENOSYS) {
+        sync();
+        result = 0;
+    }
+#else
+    sync();
+    result = 0;
+#endif
+    if (result != 0) {
+        int err = errno;
+        LOGE("Can't sync the filesystem holding \"%s\": %s\n", path,
+            strerror(err));
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
 /*
  * Release a memory mapping.
  */
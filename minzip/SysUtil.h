@@ -58,4 +58,41 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
  */
 void sysReleaseShmem(MemMapping* pMap);
 
+/*
+ * Give the kernel madvise() "advice" (MADV_SEQUENTIAL, MADV_WILLNEED,
+ * ...) about "length" bytes at "offset" into the mapped data.  The range
+ * is widened to whole pages and clipped to the mapping.  This is only a
+ * hint, so failures are logged and otherwise ignored.
+ */
+void sysAdviseMapRange(const MemMapping* pMap, size_t offset, size_t length,
+    int advice);
+
+/*
+ * fallocate(2) "length" bytes at "offset" of "fd", with "mode" 0 or
+ * FALLOC_FL_* flags.  Fails with ENOSYS where the kernel doesn't have
+ * it, and EOPNOTSUPP where the filesystem can't do it.
+ *
+ * Returns 0 on success, -1 (with errno set) on failure.
+ */
+int sysFallocate(int fd, int mode, long long offset, long long length);
+
+/*
+ * Reserve blocks for the "length" bytes about to be written at fd's
+ * current offset, without changing the file size, so the data lands in
+ * as few extents as the filesystem can manage.  This is only a hint:
+ * filesystems that can't preallocate are left alone, and failures are
+ * logged and otherwise ignored.
+ */
+void sysPreallocateFile(int fd, long long length);
+
+/*
+ * Flush everything written so far to the filesystem holding "path"
+ * (which must exist) to stable storage, with syncfs() where the kernel
+ * has it and sync() otherwise.  Call this at a commit point instead of
+ * opening files O_SYNC.
+ *
+ * Returns 0 on success, -1 (with errno set) on failure.
+ */
+int sysSyncFilesystem(const char* path);
+
 #endif /*_MINZIP_SYSUTIL*/
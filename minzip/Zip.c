@@ -3,20 +3,36 @@
  *
  * Simple Zip file support.
  */
-#include "safe_iop.h"
+#define _LARGEFILE64_SOURCE     // for pread64() on glibc hosts
 #include "zlib.h"
+#ifdef MINZIP_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef MINZIP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef MINZIP_HAVE_LZ4
+#include <lz4frame.h>
+#endif
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/mman.h>   // for MADV_*
+#include <sys/sendfile.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Crc32.h"
+#include "Hash.h"
 #include "Log.h"
 #include "DirUtil.h"
 
@@ -51,12 +67,32 @@ enum {
     ENDSIG = 0x06054b50,     // PK56
     ENDHDR = 22,
 
+    ENDDSK =  4,            // number of this disk (part)
+    ENDDCD =  6,            // disk the central directory starts on
     ENDSUB =  8,
     ENDTOT = 10,
     ENDSIZ = 12,
     ENDOFF = 16,
     ENDCOM = 20,
 
+    ZIP64_LOCSIG = 0x07064b50,  // PK67, Zip64 end-of-central-dir locator
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCDSK =  4,
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_ENDSIG = 0x06064b50,  // PK66, Zip64 end-of-central-dir record
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDDSK = 16,
+    ZIP64_ENDDCD = 20,
+    ZIP64_ENDTOT = 32,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_EXTID = 0x0001,       // Zip64 extended information extra field
+    ZIP64_MAGICVAL = 0xffffffff,
+
     EXTSIG = 0x08074b50,     // PK78
     EXTHDR = 16,
 
@@ -79,84 +115,243 @@ enum {
 
     STORED = 0,
     DEFLATED = 8,
+    ZSTD = 93,
+    LZ4 = 0x4c34,           // "4L"; APPNOTE assigns LZ4 no method, so
+                            // only our own packages use it (LZ4 frames)
 
     CENVEM_UNIX = 3 << 8,   // the high byte of CENVEM
 };
 
 
+/*
+ * Return a pointer to the (not null-terminated) name of "pEntry" in the
+ * mapped central directory.
+ */
+static inline const char* entryName(const ZipArchive* pArchive,
+    const ZipEntry* pEntry)
+{
+    return (const char*)pArchive->centralDir + pEntry->cdOffset + CENHDR;
+}
+
+/*
+ * Return a pointer to the central directory record of "pEntry".
+ */
+static inline const unsigned char* entryRecord(const ZipArchive* pArchive,
+    const ZipEntry* pEntry)
+{
+    return pArchive->centralDir + pEntry->cdOffset;
+}
+
 /*
  * For debugging, dump the contents of a ZipEntry.
  */
 #if 0
-static void dumpEntry(const ZipEntry* pEntry)
+static void dumpEntry(const ZipArchive* pArchive, const ZipEntry* pEntry)
 {
-    LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI(" %u '%.*s'\n", pEntry->cdOffset, pEntry->fileNameLen,
+        entryName(pArchive, pEntry));
+    LOGI("   off=%lld comp=%lld uncomp=%lld how=%d\n", pEntry->offset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * Compute the hash code for a ZipEntry filename.
  *
- * Compare two ZipEntry structs, by name.
+ * Eight bytes at a time, each word folded in with a multiply, then the
+ * MurmurHash3 64-bit finalizer so that both the low bits (the bucket)
+ * and the whole value (compared inline in the index) are well mixed.
+ * Names in a package share long prefixes ("system/app/..."), which the
+ * old "31 * hash + c" hash spread poorly.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static unsigned int computeHash(const char* name, unsigned int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    unsigned long long hash = 0x9e3779b97f4a7c15ULL ^ nameLen;
+    unsigned long long word;
+
+    while (nameLen >= sizeof(word)) {
+        memcpy(&word, name, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+        name += sizeof(word);
+        nameLen -= sizeof(word);
+    }
+    if (nameLen > 0) {
+        /* (a byte loop; a variable-length memcpy() is a libc call) */
+        word = 0;
+        while (nameLen--)
+            word = (word << 8) | (unsigned char) name[nameLen];
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
 
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (unsigned int) hash;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * One slot of the name index, which maps names to entries.
+ *
+ * The index is an open-addressed table with Robin Hood insertion: an
+ * entry that is further from its home slot than the resident takes the
+ * slot, and the resident moves on.  Probe lengths stay short and even,
+ * and a lookup can give up as soon as it reaches a slot whose entry is
+ * closer to home than the name being looked for would be.
  *
- * find a ZipEntry struct by name.
+ * The hash, the name length and the first bytes of the name are kept in
+ * the slot, so almost every mismatch is rejected without touching the
+ * entry table or the central directory.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+typedef struct ZipNameSlot {
+    unsigned int   hash;
+    unsigned short nameLen;
+    unsigned short dist;        // 1 + distance from home slot; 0 if empty
+    unsigned int   entryIndex;
+    unsigned int   prefix;      // first (up to) 4 bytes of the name
+} ZipNameSlot;
+
+#define NAME_PREFIX_LEN sizeof(((ZipNameSlot*)0)->prefix)
+#define NAME_SLOT_MAX_DIST 0xffff
+
+static inline unsigned int namePrefix(const char* name, unsigned int nameLen)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    unsigned int prefix = 0;
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    if (nameLen >= NAME_PREFIX_LEN) {
+        memcpy(&prefix, name, NAME_PREFIX_LEN);
+    } else {
+        while (nameLen--)
+            ((unsigned char*) &prefix)[nameLen] = name[nameLen];
+    }
+    return prefix;
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Allocate an empty name index big enough for "numEntries" names with
+ * the table at most 3/4 full.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static bool createNameIndex(ZipArchive* pArchive, unsigned int numEntries)
 {
-    unsigned int hash = 2;
+    unsigned long long want = numEntries + numEntries / 3 + 1;
+    unsigned long long tableSize = 1;
 
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    while (tableSize < want)
+        tableSize <<= 1;
+    if (tableSize > SIZE_MAX / sizeof(ZipNameSlot) || tableSize > UINT_MAX)
+        return false;
 
-    return hash;
+    pArchive->pNameIndex =
+            (ZipNameSlot*) calloc(tableSize, sizeof(ZipNameSlot));
+    pArchive->nameIndexMask = tableSize - 1;
+    return pArchive->pNameIndex != NULL;
+}
+
+/*
+ * Find the name in the index.  Returns the index of the entry, or -1 if
+ * there's no entry with that name.  "pProbes", if not NULL, is set to
+ * the number of slots looked at past the home slot.
+ */
+static int lookupName(const ZipArchive* pArchive, const char* name,
+    unsigned int nameLen, unsigned int hash, int* pProbes)
+{
+    const ZipNameSlot* slots = pArchive->pNameIndex;
+    unsigned int mask = pArchive->nameIndexMask;
+    unsigned int prefix = namePrefix(name, nameLen);
+    unsigned int i = hash & mask;
+    unsigned int dist = 1;
+    int found = -1;
+
+    for (;; i = (i + 1) & mask, dist++) {
+        const ZipNameSlot* pSlot = &slots[i];
+
+        if (pSlot->dist < dist)
+            break;      // empty, or we'd have displaced it
+        if (pSlot->hash == hash && pSlot->nameLen == nameLen &&
+            pSlot->prefix == prefix &&
+            (nameLen <= NAME_PREFIX_LEN ||
+             memcmp(entryName(pArchive, &pArchive->pEntries[pSlot->entryIndex])
+                    + NAME_PREFIX_LEN, name + NAME_PREFIX_LEN,
+                    nameLen - NAME_PREFIX_LEN) == 0))
+        {
+            found = pSlot->entryIndex;
+            break;
+        }
+    }
+    if (pProbes != NULL)
+        *pProbes = dist - 1;
+    return found;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Add entry number "index" to the name index.  If an entry with the
+ * same name is already there, it wins.  Returns false if the index is
+ * hopelessly degenerate (only possible with a crafted archive).
+ */
+static bool addEntryToNameIndex(ZipArchive* pArchive, unsigned int index)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
+    const ZipEntry* pEntry = &pArchive->pEntries[index];
+    const char* name = entryName(pArchive, pEntry);
+    ZipNameSlot* slots = pArchive->pNameIndex;
+    unsigned int mask = pArchive->nameIndexMask;
+    ZipNameSlot slot;
+    unsigned int i;
+    int found;
 
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
+    found = lookupName(pArchive, name, pEntry->fileNameLen, pEntry->nameHash,
+            NULL);
+    if (found >= 0) {
         LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
+            pEntry->fileNameLen, name);
         /* keep going */
+        return true;
+    }
+
+    slot.hash = pEntry->nameHash;
+    slot.nameLen = pEntry->fileNameLen;
+    slot.dist = 1;
+    slot.entryIndex = index;
+    slot.prefix = namePrefix(name, pEntry->fileNameLen);
+
+    for (i = slot.hash & mask; ; i = (i + 1) & mask) {
+        ZipNameSlot* pSlot = &slots[i];
+
+        if (pSlot->dist == 0) {
+            *pSlot = slot;
+            return true;
+        }
+        if (pSlot->dist < slot.dist) {
+            ZipNameSlot tmp = *pSlot;
+            *pSlot = slot;
+            slot = tmp;
+        }
+        if (slot.dist == NAME_SLOT_MAX_DIST) {
+            LOGW("Name index probe too long\n");
+            return false;
+        }
+        slot.dist++;
     }
 }
 
+/*
+ * Word-at-a-time test for a byte outside printable ASCII [32, 127), using
+ * the "hasless" and "hasmore" tricks from
+ * http://graphics.stanford.edu/~seander/bithacks.html (both are exact
+ * for thresholds up to 128).
+ */
+#define BYTES_ONES  (~0UL / 255)
+#define BYTES_HIGHS (BYTES_ONES * 128)
+
+static inline bool wordHasUnprintable(unsigned long word)
+{
+    unsigned long below = (word - BYTES_ONES * 32) & ~word;   // byte < 32
+    unsigned long above = (word + BYTES_ONES * 1) | word;     // byte > 126
+    return ((below | above) & BYTES_HIGHS) != 0;
+}
+
 static int validFilename(const char *fileName, unsigned int fileNameLen)
 {
     // Forbid super long filenames.
@@ -166,8 +361,17 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     }
 
     // Require all characters to be printable ASCII (no NUL, no UTF-8, etc).
-    unsigned int i;
-    for (i = 0; i < fileNameLen; ++i) {
+    // Check a word at a time, and only look at individual bytes in the
+    // tail or once we know something is wrong.
+    unsigned int i = 0;
+    while (i + sizeof(unsigned long) <= fileNameLen) {
+        unsigned long word;
+        memcpy(&word, fileName + i, sizeof(word));
+        if (wordHasUnprintable(word))
+            break;
+        i += sizeof(word);
+    }
+    for (; i < fileNameLen; ++i) {
         if (fileName[i] < 32 || fileName[i] >= 127) {
             LOGW("Filename contains invalid character '\%03o'\n", fileName[i]);
             return 0;
@@ -177,62 +381,474 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+#if SORT_ENTRIES
+/*
+ * What we sort on.  qsort() can't pass the archive to the comparator, so
+ * each key carries its own name pointer.
+ */
+typedef struct {
+    const char* name;
+    unsigned int nameLen;
+    unsigned int index;         // in central directory order
+} ZipSortKey;
+
+/*
+ * (This is a qsort() callback.)
+ *
+ * Order entries by name, byte-wise, with a name sorting before any
+ * longer name it is a prefix of.  Names are validated printable ASCII,
+ * so this matches strncmp() order.  Duplicate names keep their central
+ * directory order, so the first one still wins in the hash table.
+ */
+static int compareZipSortKeys(const void* vkey1, const void* vkey2)
+{
+    const ZipSortKey* key1 = (const ZipSortKey*) vkey1;
+    const ZipSortKey* key2 = (const ZipSortKey*) vkey2;
+    unsigned int minLen;
+    int diff;
+
+    minLen = key1->nameLen < key2->nameLen ? key1->nameLen : key2->nameLen;
+    diff = memcmp(key1->name, key2->name, minLen);
+    if (diff != 0)
+        return diff;
+    if (key1->nameLen != key2->nameLen)
+        return key1->nameLen < key2->nameLen ? -1 : 1;
+    if (key1->index != key2->index)
+        return key1->index < key2->index ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Put the entries of "pArchive" in name order.  Returns false if we run
+ * out of memory.
+ */
+static bool sortZipEntries(ZipArchive* pArchive)
+{
+    unsigned int i, numEntries = pArchive->numEntries;
+    ZipSortKey* keys;
+    ZipEntry* sorted;
+
+    keys = (ZipSortKey*) malloc(numEntries * sizeof(ZipSortKey));
+    sorted = (ZipEntry*) malloc(numEntries * sizeof(ZipEntry));
+    if (keys == NULL || sorted == NULL) {
+        free(keys);
+        free(sorted);
+        return false;
+    }
+    for (i = 0; i < numEntries; i++) {
+        keys[i].name = entryName(pArchive, &pArchive->pEntries[i]);
+        keys[i].nameLen = pArchive->pEntries[i].fileNameLen;
+        keys[i].index = i;
+    }
+    qsort(keys, numEntries, sizeof(ZipSortKey), compareZipSortKeys);
+    for (i = 0; i < numEntries; i++) {
+        sorted[i] = pArchive->pEntries[keys[i].index];
+    }
+    free(keys);
+    free(pArchive->pEntries);
+    pArchive->pEntries = sorted;
+    return true;
+}
+#endif
+
+/*
+ * Pick the 64-bit sizes and offset out of a central directory entry's
+ * Zip64 extra field, if it has one.  Only the values whose 32-bit CD
+ * fields were saturated (0xffffffff) are present, in this order.
+ *
+ * Returns "false" if the extra data is malformed.
+ */
+static bool parseZip64ExtraField(const unsigned char* extra,
+    unsigned int extraLen, unsigned long long* pUncompLen,
+    unsigned long long* pCompLen, unsigned long long* pLocalHdrOffset)
+{
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int size = get2LE(extra + 2);
+        const unsigned char* data = extra + 4;
+
+        if (size > extraLen - 4)
+            return false;
+        if (id == ZIP64_EXTID) {
+            unsigned long long* fields[3] = {
+                pUncompLen, pCompLen, pLocalHdrOffset
+            };
+            int i;
+
+            for (i = 0; i < 3; i++) {
+                if (*fields[i] != ZIP64_MAGICVAL)
+                    continue;
+                if (data + 8 > extra + 4 + size)
+                    return false;
+                *fields[i] = get8LE(data);
+                data += 8;
+            }
+            return true;
+        }
+        extra += 4 + size;
+        extraLen -= 4 + size;
+    }
+    return true;
+}
+
+/*
+ * Read exactly "count" bytes at "offset" without touching the file
+ * offset, so any number of threads can read from the same fd.
+ */
+static bool preadFully(int fd, void* buf, size_t count, long long offset)
+{
+    unsigned char* p = (unsigned char*) buf;
+
+    while (count > 0) {
+        ssize_t n = pread64(fd, p, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOGE("Can't read %zu bytes from zip file at %lld: %s\n",
+                count, offset, n < 0 ? strerror(errno) : "EOF");
+            return false;
+        }
+        p += n;
+        offset += n;
+        count -= n;
+    }
+    return true;
+}
+
+/*
+ * Write all "count" bytes of "buf" to "fd".
+ */
+static bool writeFully(int fd, const void* buf, size_t count)
+{
+    const unsigned char* p = (const unsigned char*) buf;
+
+    while (count > 0) {
+        ssize_t n = write(fd, p, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOGE("Can't write %zu bytes: %s\n", count,
+                n < 0 ? strerror(errno) : "no progress");
+            return false;
+        }
+        p += n;
+        count -= n;
+    }
+    return true;
+}
+
+/*
+ * One file of a split archive.
+ */
+typedef struct ZipPart {
+    int         fd;
+    long long   start;          // offset of its first byte in the archive
+    long long   length;
+} ZipPart;
+
+/*
+ * Find the file holding byte "offset" of the archive.  Returns its fd,
+ * with the offset within that file in *pPartOffset and the number of
+ * bytes from there to the end of the file in *pPartLeft, or -1 if
+ * "offset" is outside the archive.
+ */
+static int findArchivePart(const ZipArchive* pArchive, long long offset,
+    long long* pPartOffset, long long* pPartLeft)
+{
+    const ZipPart* pPart;
+    unsigned int lo, hi;
+
+    if (pArchive->numParts == 0) {
+        *pPartOffset = offset;
+        *pPartLeft = LLONG_MAX - offset;
+        return pArchive->fd;
+    }
+
+    /* find the last part starting at or before "offset" */
+    lo = 0;
+    hi = pArchive->numParts;
+    while (hi - lo > 1) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (pArchive->parts[mid].start <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    pPart = &pArchive->parts[lo];
+    if (offset < pPart->start || offset - pPart->start >= pPart->length) {
+        LOGE("Offset %lld is outside the split zip file\n", offset);
+        return -1;
+    }
+    *pPartOffset = offset - pPart->start;
+    *pPartLeft = pPart->length - *pPartOffset;
+    return pPart->fd;
+}
+
+/*
+ * preadFully() from the archive, which may be split over several files.
+ */
+static bool archivePread(const ZipArchive* pArchive, void* buf, size_t count,
+    long long offset)
+{
+    unsigned char* p = (unsigned char*) buf;
+
+    while (count > 0) {
+        long long partOffset, partLeft;
+        size_t n = count;
+        int fd;
+
+        fd = findArchivePart(pArchive, offset, &partOffset, &partLeft);
+        if (fd < 0)
+            return false;
+        if ((long long) n > partLeft)
+            n = partLeft;
+        if (!preadFully(fd, p, n, partOffset))
+            return false;
+        p += n;
+        offset += n;
+        count -= n;
+    }
+    return true;
+}
+
+/*
+ * Pass posix_fadvise() advice for a range of the archive on to the files
+ * it's in.
+ */
+static void adviseArchiveRange(const ZipArchive* pArchive, long long offset,
+    long long length, int advice)
+{
+    while (length > 0) {
+        long long partOffset, partLeft;
+        int fd;
+
+        fd = findArchivePart(pArchive, offset, &partOffset, &partLeft);
+        if (fd < 0)
+            return;
+        if (partLeft > length)
+            partLeft = length;
+        posix_fadvise64(fd, partOffset, partLeft, advice);
+        offset += partLeft;
+        length -= partLeft;
+    }
+}
+
+/*
+ * In a spanned archive (pkg.z01, ..., pkg.zip), offsets in the directory
+ * are from the start of the part named by a disk number.  Turn one into
+ * an offset in the archive as a whole.  Disk numbers are ignored in an
+ * archive that's in one piece, even if it's been cut into several files.
+ */
+static bool diskToArchiveOffset(const ZipArchive* pArchive, unsigned int disk,
+    unsigned long long* pOffset)
+{
+    if (!pArchive->spanned)
+        return true;
+    if (disk >= pArchive->numParts ||
+            *pOffset >= (unsigned long long) pArchive->parts[disk].length) {
+        LOGW("Bad offset %llu on disk %u of split zip\n", *pOffset, disk);
+        return false;
+    }
+    *pOffset += pArchive->parts[disk].start;
+    return true;
+}
+
+/*
+ * Find the central directory.  The EOCD is somewhere in the last 64K of
+ * the file (more only if the comment is longer than a Zip allows), so
+ * only that much is read, plus the Zip64 EOCD record if there is one.
+ *
+ * Returns "true" on success, with the number of entries and the offset
+ * and size of the central directory filled in.
+ */
+static bool findCentralDir(const ZipArchive* pArchive, long long fileLength,
+    unsigned int* pNumEntries, unsigned long long* pCdOffset,
+    unsigned long long* pCdSize)
+{
+    bool result = false;
+    unsigned char* tail;
+    const unsigned char* ptr;
+    size_t tailLen, pos;
+    unsigned long long tailOffset, eocdOffset, cdEnd;
+    unsigned long long cdOffset, cdSize;
+    unsigned int numEntries, cdDisk;
+
+    tailLen = ZIP64_LOCHDR + ENDHDR + 0xffff;
+    if ((long long) tailLen > fileLength)
+        tailLen = fileLength;
+    tailOffset = fileLength - tailLen;
+    tail = (unsigned char*) malloc(tailLen);
+    if (tail == NULL) {
+        LOGE("Can't allocate %zu bytes for end of Zip\n", tailLen);
+        goto bail;
+    }
+    if (!archivePread(pArchive, tail, tailLen, tailOffset))
+        goto bail;
+
+    /*
+     * Find the EOCD.  We'll find it immediately unless they have a file
+     * comment.
+     */
+    pos = tailLen - ENDHDR;
+    while (tail[pos] != (ENDSIG & 0xff) || get4LE(tail + pos) != ENDSIG) {
+        if (pos == 0) {
+            LOGI("Could not find end-of-central-directory in Zip\n");
+            goto bail;
+        }
+        pos--;
+    }
+    ptr = tail + pos;
+    eocdOffset = tailOffset + pos;
+
+    /*
+     * There are three interesting items in the EOCD block: the number of
+     * entries in the file, and the file offset and size of the central
+     * directory, which must end before the EOCD does.  A spanned archive
+     * ends with its last part, so that's the disk the EOCD is on.
+     */
+    numEntries = get2LE(ptr + ENDSUB);
+    cdSize = get4LE(ptr + ENDSIZ);
+    cdOffset = get4LE(ptr + ENDOFF);
+    cdDisk = get2LE(ptr + ENDDCD);
+    cdEnd = eocdOffset;
+    if (pArchive->spanned) {
+        if (get2LE(ptr + ENDDSK) != pArchive->numParts - 1) {
+            LOGW("Split zip has %u parts, but its directory says %u\n",
+                pArchive->numParts, get2LE(ptr + ENDDSK) + 1);
+            goto bail;
+        }
+        numEntries = get2LE(ptr + ENDTOT);
+    }
+
+    /*
+     * Zip64 archives put a locator immediately before the EOCD, pointing
+     * at a larger record that holds the real entry count and offset.
+     */
+    if (pos >= ZIP64_LOCHDR && get4LE(ptr - ZIP64_LOCHDR) == ZIP64_LOCSIG) {
+        unsigned char endRec[ZIP64_ENDHDR];
+        unsigned long long endOffset, totalEntries;
+
+        endOffset = get8LE(ptr - ZIP64_LOCHDR + ZIP64_LOCOFF);
+        if (!diskToArchiveOffset(pArchive,
+                get4LE(ptr - ZIP64_LOCHDR + ZIP64_LOCDSK), &endOffset))
+            goto bail;
+        if (endOffset > eocdOffset - ZIP64_LOCHDR ||
+                eocdOffset - ZIP64_LOCHDR - endOffset < ZIP64_ENDHDR)
+        {
+            LOGW("Bad offset to Zip64 end-of-central-directory: %llu\n",
+                endOffset);
+            goto bail;
+        }
+        if (!archivePread(pArchive, endRec, sizeof(endRec), endOffset))
+            goto bail;
+        if (get4LE(endRec) != ZIP64_ENDSIG) {
+            LOGW("Missed the Zip64 end-of-central-directory sig\n");
+            goto bail;
+        }
+        totalEntries = get8LE(endRec + ZIP64_ENDTOT);
+        if (totalEntries > UINT_MAX) {
+            LOGW("Too many entries in Zip64 archive (%llu)\n", totalEntries);
+            goto bail;
+        }
+        numEntries = totalEntries;
+        cdSize = get8LE(endRec + ZIP64_ENDSIZ);
+        cdOffset = get8LE(endRec + ZIP64_ENDOFF);
+        cdDisk = get4LE(endRec + ZIP64_ENDDCD);
+        cdEnd = endOffset;
+    }
+    if (!diskToArchiveOffset(pArchive, cdDisk, &cdOffset))
+        goto bail;
+
+    LOGVV("numEntries=%u cdOffset=%llu cdSize=%llu\n",
+        numEntries, cdOffset, cdSize);
+    if (numEntries == 0 || cdOffset > cdEnd || cdSize > cdEnd - cdOffset) {
+        LOGW("Invalid entries=%u offset=%llu size=%llu (len=%lld)\n",
+            numEntries, cdOffset, cdSize, fileLength);
+        goto bail;
+    }
+
+    *pNumEntries = numEntries;
+    *pCdOffset = cdOffset;
+    *pCdSize = cdSize;
+    result = true;
+
+bail:
+    free(tail);
+    return result;
+}
+
+/*
+ * Point pArchive->centralDir at the central directory: in the mapping if
+ * there is one, otherwise read into pArchive->dirBuf.
+ */
+static bool loadCentralDir(ZipArchive* pArchive, const MemMapping* pMap,
+    unsigned long long cdOffset, unsigned long long cdSize)
+{
+    if (cdSize != (size_t) cdSize) {
+        LOGW("Central directory too large (%llu bytes)\n", cdSize);
+        return false;
+    }
+    if (pMap != NULL) {
+        pArchive->centralDir = (const unsigned char*)pMap->addr + cdOffset;
+        return true;
+    }
+
+    pArchive->dirBuf = (unsigned char*) malloc(cdSize > 0 ? cdSize : 1);
+    if (pArchive->dirBuf == NULL) {
+        LOGE("Can't allocate %llu bytes for central directory\n", cdSize);
+        return false;
+    }
+    if (!archivePread(pArchive, pArchive->dirBuf, cdSize, cdOffset)) {
+        free(pArchive->dirBuf);
+        pArchive->dirBuf = NULL;
+        return false;
+    }
+    pArchive->centralDir = pArchive->dirBuf;
+    return true;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
  * store it in a hash table.
  *
+ * If "pMap" is NULL, only the central directory is read (into
+ * pArchive->dirBuf), and the local headers aren't looked at until each
+ * entry is read; the entries hold local header offsets until then.
+ *
  * Returns "true" on success.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap,
+    long long fileLength)
 {
     bool result = false;
+    unsigned char sig[4];
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    const unsigned char* cdEnd;
+    unsigned int i, numEntries;
     unsigned int val;
+    unsigned long long cdOffset, cdSize;
 
     /*
      * The first 4 bytes of the file will either be the local header
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
+     * A spanned archive may start with a marker that has EXTSIG's value.
      */
-    val = get4LE(pMap->addr);
+    if (!archivePread(pArchive, sig, sizeof(sig), 0))
+        goto bail;
+    val = get4LE(sig);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
-    } else if (val != LOCSIG) {
+    } else if (val != LOCSIG && !(pArchive->spanned && val == EXTSIG)) {
         LOGV("Not a Zip archive (found 0x%08x)\n", val);
         goto bail;
     }
 
-    /*
-     * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
-     */
-    ptr = pMap->addr + pMap->length - ENDHDR;
-
-    while (ptr >= (const unsigned char*) pMap->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
-            break;
-        ptr--;
-    }
-    if (ptr < (const unsigned char*) pMap->addr) {
-        LOGI("Could not find end-of-central-directory in Zip\n");
-        goto bail;
-    }
-
-    /*
-     * There are two interesting items in the EOCD block: the number of
-     * entries in the file, and the file offset of the start of the
-     * central directory.
-     */
-    numEntries = get2LE(ptr + ENDSUB);
-    cdOffset = get4LE(ptr + ENDOFF);
-
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    if (!findCentralDir(pArchive, fileLength, &numEntries, &cdOffset,
+            &cdSize))
+    {
         goto bail;
     }
 
@@ -241,18 +857,23 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL || !createNameIndex(pArchive, numEntries))
+        goto bail;
+
+    if (!loadCentralDir(pArchive, pMap, cdOffset, cdSize))
         goto bail;
+    pArchive->headerOffsets = (pMap == NULL);
+    cdEnd = pArchive->centralDir + cdSize;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = pArchive->centralDir;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
+        unsigned int fileNameLen, extraLen, commentLen;
+        unsigned long long localHdrOffset, compLen, uncompLen;
         const unsigned char* localHdr;
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if ((size_t)(cdEnd - ptr) < CENHDR) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -260,13 +881,18 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             LOGW("Missed a central dir sig (at %d)\n", i);
             goto bail;
         }
+        if ((size_t)(ptr - pArchive->centralDir) > UINT_MAX) {
+            LOGW("Central directory too large (at %d)\n", i);
+            goto bail;
+        }
 
         localHdrOffset = get4LE(ptr + CENOFF);
         fileNameLen = get2LE(ptr + CENNAM);
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if ((size_t)(cdEnd - (const unsigned char*)fileName) <
+                fileNameLen + extraLen) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,131 +901,107 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
 
+        pEntry->cdOffset = ptr - pArchive->centralDir;
         pEntry->fileNameLen = fileNameLen;
-        pEntry->fileName = fileName;
-
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
-        pEntry->compression = get2LE(ptr + CENHOW);
-        pEntry->modTime = get4LE(ptr + CENTIM);
-        pEntry->crc32 = get4LE(ptr + CENCRC);
+        pEntry->nameHash = computeHash(fileName, fileNameLen);
 
-        /* These two are necessary for finding the mode of the file.
-         */
-        pEntry->versionMadeBy = get2LE(ptr + CENVEM);
-        if ((pEntry->versionMadeBy & 0xff00) != 0 &&
-                (pEntry->versionMadeBy & 0xff00) != CENVEM_UNIX)
-        {
-            LOGW("Incompatible \"version made by\": 0x%02x (at %d)\n",
-                    pEntry->versionMadeBy >> 8, i);
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
+        if (!parseZip64ExtraField((const unsigned char*)fileName + fileNameLen,
+                extraLen, &uncompLen, &compLen, &localHdrOffset)) {
+            LOGW("Bad Zip64 extra field (at %d)\n", i);
             goto bail;
         }
-        pEntry->externalFileAttributes = get4LE(ptr + CENATX);
-
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        if (!diskToArchiveOffset(pArchive, get2LE(ptr + CENDSK),
+                &localHdrOffset)) {
+            LOGW("Bad disk number (at %d)\n", i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        if (compLen > LLONG_MAX || uncompLen > LLONG_MAX) {
+            LOGW("Entry too large (at %d)\n", i);
             goto bail;
         }
-        if (get4LE(localHdr) != LOCSIG) {
-            LOGW("Missed a local header sig (at %d)\n", i);
+        pEntry->compLen = compLen;
+        pEntry->uncompLen = uncompLen;
+        pEntry->compression = get2LE(ptr + CENHOW);
+        pEntry->crc32 = get4LE(ptr + CENCRC);
+
+        /* "version made by" and the external attributes are needed for
+         * finding the mode of the file; they're read again when asked for.
+         */
+        val = get2LE(ptr + CENVEM);
+        if ((val & 0xff00) != 0 && (val & 0xff00) != CENVEM_UNIX) {
+            LOGW("Incompatible \"version made by\": 0x%02x (at %d)\n",
+                    val >> 8, i);
             goto bail;
         }
-        pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+
+        // localHdrOffset and compLen are untrusted; compare them against
+        // what's left of the file rather than adding to pointers.
+        if ((unsigned long long)fileLength < LOCHDR ||
+                localHdrOffset > (unsigned long long)fileLength - LOCHDR) {
+            LOGW("Bad offset to local header: %llu (at %d)\n",
+                localHdrOffset, i);
             goto bail;
         }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
-            LOGW("Data ran off the end (at %d)\n", i);
-            goto bail;
+        if (pMap == NULL) {
+            /* Leave the local header for getEntryDataOffset(); reading
+             * it now would touch a page of every entry in the file.
+             */
+            if (compLen > (unsigned long long)fileLength - LOCHDR -
+                    localHdrOffset) {
+                LOGW("Data ran off the end (at %d)\n", i);
+                goto bail;
+            }
+            pEntry->offset = localHdrOffset;
+        } else {
+            localHdr = (const unsigned char*)pMap->addr + localHdrOffset;
+            if (get4LE(localHdr) != LOCSIG) {
+                LOGW("Missed a local header sig (at %d)\n", i);
+                goto bail;
+            }
+            pEntry->offset = localHdrOffset + LOCHDR
+                + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
+            if ((unsigned long long)pEntry->offset > pMap->length ||
+                    compLen > pMap->length - pEntry->offset) {
+                LOGW("Data ran off the end (at %d)\n", i);
+                goto bail;
+            }
         }
 
 #if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
+        /* Add to the name index; no need to lock here.
          * Can't do this now if we're sorting, because entries
          * will move around.
          */
-        addEntryToHashTable(pArchive->pHash, pEntry);
+        if (!addEntryToNameIndex(pArchive, i))
+            goto bail;
 #endif
 
-        //dumpEntry(pEntry);
+        //dumpEntry(pArchive, pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
 #if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort once, now that everything has been read.  (Inserting each
+     * entry in place is O(n^2) moves on big packages.)
+     *
+     * We have to wait until all entries are in their final places
+     * before indexing them, otherwise the indices will point to the
+     * wrong things.
      */
+    if (!sortZipEntries(pArchive))
+        goto bail;
     for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
+        /* Add to the name index; no need to lock here.
          */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+        if (!addEntryToNameIndex(pArchive, i))
+            goto bail;
     }
 #endif
 
@@ -407,19 +1009,459 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pNameIndex);
+        pArchive->pNameIndex = NULL;
+    }
+    return result;
+}
+
+/*
+ * A saved copy of an archive's entries and name index, so the next open
+ * of the same package -- by the updater, after recovery has opened it,
+ * or on a repeated install -- reads the tables instead of parsing the
+ * central directory again.  It's only used if the package's size, mtime
+ * and central directory all match what was saved, and its own contents
+ * check out.  The entries and name slots follow the header, in the
+ * in-memory layout.
+ */
+#define ZIP_INDEX_MAGIC     0x5849494d  // "MIIX"
+#define ZIP_INDEX_VERSION   1           // bump if the hash or layouts change
+
+typedef struct ZipIndexHeader {
+    unsigned int        magic;
+    unsigned int        version;
+    unsigned int        entrySize;      // sizeof(ZipEntry)
+    unsigned int        slotSize;       // sizeof(ZipNameSlot)
+    long long           fileLength;
+    long long           mtime;
+    unsigned long long  cdOffset;
+    unsigned long long  cdSize;
+    unsigned int        cdCrc;
+    unsigned int        numEntries;
+    unsigned int        nameIndexMask;
+    unsigned int        headerOffsets;  // ZipArchive.headerOffsets
+    unsigned int        bodyCrc;        // of the entries and name slots
+    unsigned int        reserved;
+} ZipIndexHeader;
+
+/*
+ * Check the entries and name slots of a loaded index against the
+ * central directory.  The index isn't covered by the package's
+ * signature, and its CRCs only catch accidents, so nothing in it is
+ * trusted: every entry must name a record in the central directory with
+ * a valid file name, and carry that record's name hash, method, CRC and
+ * sizes.  Its data must start at (or, for a mapped archive, just past)
+ * the record's local header and lie inside the file; "pMap", if not
+ * NULL, is the mapped archive, whose local headers are checked too.
+ * Every used name slot must point at an entry whose name is as long as
+ * the slot says.
+ */
+static bool checkZipIndex(const ZipArchive* pArchive, const MemMapping* pMap,
+    const ZipEntry* pEntries, unsigned int numEntries,
+    const ZipNameSlot* pNameIndex, unsigned int nameIndexMask,
+    unsigned long long cdSize, long long fileLength, bool headerOffsets)
+{
+    unsigned long long minData = headerOffsets ? LOCHDR : 0;
+    unsigned int i;
+
+    if ((unsigned long long) fileLength < minData)
+        return false;
+    for (i = 0; i < numEntries; i++) {
+        const ZipEntry* pEntry = &pEntries[i];
+        const unsigned char* ptr = pArchive->centralDir + pEntry->cdOffset;
+        const char* fileName = (const char*) ptr + CENHDR;
+        unsigned long long localHdrOffset, compLen, uncompLen;
+        unsigned int extraLen;
+
+        if ((unsigned long long) pEntry->cdOffset + CENHDR +
+                pEntry->fileNameLen > cdSize ||
+                get4LE(ptr) != CENSIG ||
+                get2LE(ptr + CENNAM) != pEntry->fileNameLen ||
+                !validFilename(fileName, pEntry->fileNameLen) ||
+                computeHash(fileName, pEntry->fileNameLen) !=
+                        pEntry->nameHash)
+        {
+            LOGW("Bad name in archive index (at %u)\n", i);
+            return false;
+        }
+
+        /* Read the rest of the record as parseZipArchive() does.
+         */
+        extraLen = get2LE(ptr + CENEXT);
+        localHdrOffset = get4LE(ptr + CENOFF);
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
+        if ((unsigned long long) pEntry->cdOffset + CENHDR +
+                pEntry->fileNameLen + extraLen > cdSize ||
+                !parseZip64ExtraField((const unsigned char*) fileName +
+                        pEntry->fileNameLen, extraLen,
+                        &uncompLen, &compLen, &localHdrOffset) ||
+                !diskToArchiveOffset(pArchive, get2LE(ptr + CENDSK),
+                        &localHdrOffset) ||
+                pEntry->compression != get2LE(ptr + CENHOW) ||
+                pEntry->crc32 != get4LE(ptr + CENCRC) ||
+                (unsigned long long) pEntry->compLen != compLen ||
+                (unsigned long long) pEntry->uncompLen != uncompLen)
+        {
+            LOGW("Archive index doesn't match the central directory "
+                    "(at %u)\n", i);
+            return false;
+        }
+        /* A mapped archive's offsets are past the local header.  Without
+         * the mapping, the lengths of its name and extra field aren't
+         * known, so only the most they could add is checked.
+         */
+        if (!headerOffsets && pMap != NULL) {
+            const unsigned char* localHdr;
+
+            if (localHdrOffset > pMap->length ||
+                    pMap->length - localHdrOffset < LOCHDR)
+            {
+                LOGW("Bad data offset in archive index (at %u)\n", i);
+                return false;
+            }
+            localHdr = (const unsigned char*) pMap->addr + localHdrOffset;
+            if (get4LE(localHdr) != LOCSIG ||
+                    (unsigned long long) pEntry->offset != localHdrOffset +
+                            LOCHDR + get2LE(localHdr + LOCNAM) +
+                            get2LE(localHdr + LOCEXT))
+            {
+                LOGW("Bad data offset in archive index (at %u)\n", i);
+                return false;
+            }
+        }
+        if ((unsigned long long) pEntry->offset < localHdrOffset ||
+                (headerOffsets ?
+                        (unsigned long long) pEntry->offset != localHdrOffset :
+                        ((unsigned long long) pEntry->offset -
+                                localHdrOffset < LOCHDR ||
+                         (unsigned long long) pEntry->offset -
+                                localHdrOffset > LOCHDR + 0xffff + 0xffff)))
+        {
+            LOGW("Bad data offset in archive index (at %u)\n", i);
+            return false;
+        }
+        if (pEntry->offset < 0 || pEntry->compLen < 0 ||
+                pEntry->uncompLen < 0 ||
+                (unsigned long long) pEntry->offset >
+                        (unsigned long long) fileLength - minData ||
+                (unsigned long long) pEntry->compLen >
+                        (unsigned long long) fileLength - minData -
+                        pEntry->offset)
+        {
+            LOGW("Bad data range in archive index (at %u)\n", i);
+            return false;
+        }
+    }
+    for (i = 0; i <= nameIndexMask; i++) {
+        const ZipNameSlot* pSlot = &pNameIndex[i];
+
+        if (pSlot->dist == 0)
+            continue;
+        if (pSlot->entryIndex >= numEntries ||
+                pSlot->nameLen != pEntries[pSlot->entryIndex].fileNameLen)
+        {
+            LOGW("Bad name slot in archive index (at %u)\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Try to set up "pArchive" from the index at "indexPath".  The archive's
+ * fd is open, and it's mapped at "pMap" unless that's NULL.
+ *
+ * The tables are read into memory and the index file is closed again,
+ * so nothing keeps the filesystem it's on busy.
+ *
+ * Returns "true" on success.  On failure "pArchive" is left as it was.
+ */
+static bool loadZipIndex(ZipArchive* pArchive, const MemMapping* pMap,
+    long long fileLength, long long mtime, const char* indexPath)
+{
+    bool result = false;
+    ZipIndexHeader hdr;
+    ZipEntry* pEntries = NULL;
+    ZipNameSlot* pNameIndex = NULL;
+    unsigned long long entriesLen, slotsLen, cdOffset, cdSize;
+    unsigned int numEntries;
+    struct stat sb;
+    int fd;
+
+    fd = open(indexPath, O_RDONLY, 0);
+    if (fd < 0) {
+        LOGV("No archive index at %s\n", indexPath);
+        return false;
+    }
+    if (fstat(fd, &sb) != 0 || sb.st_size < (off_t) sizeof(hdr) ||
+            !preadFully(fd, &hdr, sizeof(hdr), 0))
+    {
+        goto stale;
+    }
+    if (hdr.magic != ZIP_INDEX_MAGIC || hdr.version != ZIP_INDEX_VERSION ||
+            hdr.entrySize != sizeof(ZipEntry) ||
+            hdr.slotSize != sizeof(ZipNameSlot) ||
+            hdr.fileLength != fileLength || hdr.mtime != mtime)
+    {
+        goto stale;
+    }
+    entriesLen = (unsigned long long) hdr.numEntries * sizeof(ZipEntry);
+    slotsLen = ((unsigned long long) hdr.nameIndexMask + 1) *
+            sizeof(ZipNameSlot);
+    if (hdr.numEntries == 0 || (hdr.nameIndexMask & (hdr.nameIndexMask + 1)) ||
+            (unsigned long long) sb.st_size - sizeof(hdr) !=
+                    entriesLen + slotsLen ||
+            entriesLen > SIZE_MAX || slotsLen > SIZE_MAX)
+    {
+        goto stale;
+    }
+
+    pEntries = (ZipEntry*) malloc(entriesLen);
+    pNameIndex = (ZipNameSlot*) malloc(slotsLen);
+    if (pEntries == NULL || pNameIndex == NULL) {
+        LOGW("Can't allocate %llu bytes for archive index\n",
+                entriesLen + slotsLen);
+        goto bail;
+    }
+    if (!preadFully(fd, pEntries, entriesLen, sizeof(hdr)) ||
+            !preadFully(fd, pNameIndex, slotsLen, sizeof(hdr) + entriesLen))
+    {
+        goto stale;
+    }
+    close(fd);
+    fd = -1;
+
+    if (mzCrc32(mzCrc32(0, (const unsigned char*) pEntries, entriesLen),
+            (const unsigned char*) pNameIndex, slotsLen) != hdr.bodyCrc)
+    {
+        LOGW("Archive index %s is corrupt\n", indexPath);
+        goto bail;
+    }
+
+    /* The package may have been replaced by one with the same size and
+     * mtime, so compare the central directory too.
+     */
+    if (!findCentralDir(pArchive, fileLength, &numEntries, &cdOffset,
+            &cdSize) || numEntries != hdr.numEntries ||
+            cdOffset != hdr.cdOffset || cdSize != hdr.cdSize)
+    {
+        goto stale;
     }
+    if (!loadCentralDir(pArchive, pMap, cdOffset, cdSize))
+        goto bail;
+    if (mzCrc32(0, pArchive->centralDir, cdSize) != hdr.cdCrc ||
+            !checkZipIndex(pArchive, pMap, pEntries, hdr.numEntries,
+                    pNameIndex, hdr.nameIndexMask, cdSize, fileLength,
+                    hdr.headerOffsets != 0))
+    {
+        free(pArchive->dirBuf);
+        pArchive->dirBuf = NULL;
+        pArchive->centralDir = NULL;
+        goto stale;
+    }
+
+    pArchive->numEntries = hdr.numEntries;
+    pArchive->pEntries = pEntries;
+    pArchive->pNameIndex = pNameIndex;
+    pArchive->nameIndexMask = hdr.nameIndexMask;
+    pArchive->headerOffsets = hdr.headerOffsets != 0;
+    pEntries = NULL;
+    pNameIndex = NULL;
+    result = true;
+    goto bail;
+
+stale:
+    LOGV("Archive index %s is stale\n", indexPath);
+bail:
+    free(pEntries);
+    free(pNameIndex);
+    if (fd >= 0)
+        close(fd);
     return result;
 }
 
+/*
+ * Write an index of the freshly parsed "pArchive" to "indexPath", for
+ * loadZipIndex().  Failing to is only worth a warning.
+ */
+static void saveZipIndex(const ZipArchive* pArchive, long long fileLength,
+    long long mtime, const char* indexPath)
+{
+    ZipIndexHeader hdr;
+    char tmpPath[PATH_MAX];
+    size_t entriesLen, slotsLen;
+    unsigned int numEntries;
+    int fd;
+    bool ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (!findCentralDir(pArchive, fileLength, &numEntries, &hdr.cdOffset,
+            &hdr.cdSize))
+    {
+        return;
+    }
+    entriesLen = pArchive->numEntries * sizeof(ZipEntry);
+    slotsLen = (pArchive->nameIndexMask + 1) * sizeof(ZipNameSlot);
+
+    hdr.magic = ZIP_INDEX_MAGIC;
+    hdr.version = ZIP_INDEX_VERSION;
+    hdr.entrySize = sizeof(ZipEntry);
+    hdr.slotSize = sizeof(ZipNameSlot);
+    hdr.fileLength = fileLength;
+    hdr.mtime = mtime;
+    hdr.cdCrc = mzCrc32(0, pArchive->centralDir, hdr.cdSize);
+    hdr.numEntries = pArchive->numEntries;
+    hdr.nameIndexMask = pArchive->nameIndexMask;
+    hdr.headerOffsets = pArchive->headerOffsets;
+    hdr.bodyCrc = mzCrc32(mzCrc32(0,
+            (const unsigned char*) pArchive->pEntries, entriesLen),
+            (const unsigned char*) pArchive->pNameIndex, slotsLen);
+
+    /* Write it under a temporary name and rename it into place, so a
+     * reader never sees half an index.
+     */
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", indexPath) >=
+            (int) sizeof(tmpPath)) {
+        return;
+    }
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGW("Can't create archive index %s: %s\n", tmpPath, strerror(errno));
+        return;
+    }
+    ok = writeFully(fd, &hdr, sizeof(hdr)) &&
+            writeFully(fd, pArchive->pEntries, entriesLen) &&
+            writeFully(fd, pArchive->pNameIndex, slotsLen);
+    if (close(fd) != 0)
+        ok = false;
+    if (ok && rename(tmpPath, indexPath) != 0) {
+        LOGW("Can't rename %s: %s\n", tmpPath, strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmpPath);
+        return;
+    }
+    LOGV("Saved archive index %s\n", indexPath);
+}
+
+/*
+ * Most parts a split archive can have.
+ */
+#define MAX_ZIP_PARTS 999
+
+/*
+ * Work out whether "fileName" is (the first or, for a spanned archive,
+ * last) part of a split archive, and if it is write the name of part
+ * "index" (from 0) to "partName".  Returns false if it isn't split, or
+ * there's no such part.
+ */
+static bool getZipPartName(const char* fileName, unsigned int index,
+    char* partName, size_t partNameLen)
+{
+    size_t len = strlen(fileName);
+    int n;
+
+    if (len > 4 && strcmp(fileName + len - 4, ".001") == 0) {
+        /* pkg.zip.001, pkg.zip.002, ... */
+        if (index >= MAX_ZIP_PARTS)
+            return false;
+        n = snprintf(partName, partNameLen, "%.*s.%03u", (int) len - 4,
+                fileName, index + 1);
+    } else if (len > 4 && strcasecmp(fileName + len - 4, ".zip") == 0) {
+        /* pkg.z01, pkg.z02, ..., pkg.zip */
+        struct stat sb;
+        char z = fileName[len - 3];
+
+        if (index >= MAX_ZIP_PARTS)
+            return false;
+        n = snprintf(partName, partNameLen, "%.*s%c%02u", (int) len - 3,
+                fileName, z, index + 1);
+        if (n < 0 || (size_t) n >= partNameLen)
+            return false;
+        if (stat(partName, &sb) == 0)
+            return true;
+        if (index == 0)
+            return false;       /* no pkg.z01, so not split */
+        n = snprintf(partName, partNameLen, "%s", fileName);
+    } else {
+        return false;
+    }
+    return n >= 0 && (size_t) n < partNameLen;
+}
+
+/*
+ * Open the files of a split archive, if "fileName" names one.  Returns 0
+ * and fills in pArchive->parts (and *pFileLength) if it does, 0 with no
+ * parts if it doesn't, and an errno value if the parts can't be opened.
+ */
+static int openZipParts(const char* fileName, ZipArchive* pArchive,
+    long long* pFileLength)
+{
+    char partName[PATH_MAX];
+    long long start = 0;
+    unsigned int i;
+    int err = 0;
+
+    for (i = 0; getZipPartName(fileName, i, partName, sizeof(partName)); i++) {
+        ZipPart* pPart;
+        ZipPart* newParts;
+        int fd;
+
+        fd = open(partName, O_RDONLY, 0);
+        if (fd < 0) {
+            if (errno == ENOENT && i > 0 && !pArchive->spanned)
+                break;          /* the end of pkg.zip.NNN */
+            err = errno ? errno : -1;
+            LOGV("Unable to open '%s': %s\n", partName, strerror(err));
+            break;
+        }
+        newParts = (ZipPart*) realloc(pArchive->parts,
+                (i + 1) * sizeof(ZipPart));
+        if (newParts == NULL) {
+            close(fd);
+            err = ENOMEM;
+            break;
+        }
+        pArchive->parts = newParts;
+        pArchive->numParts = i + 1;
+        pPart = &pArchive->parts[i];
+        pPart->fd = fd;
+        pPart->start = start;
+        pPart->length = lseek64(fd, 0, SEEK_END);
+        if (pPart->length < 0) {
+            err = errno ? errno : -1;
+            LOGV("Unable to seek '%s': %s\n", partName, strerror(err));
+            break;
+        }
+        start += pPart->length;
+
+        if (i == 0)
+            pArchive->spanned = strcmp(partName, fileName) != 0;
+        else if (pArchive->spanned && strcmp(partName, fileName) == 0)
+            break;              /* pkg.zip comes last */
+    }
+
+    *pFileLength = start;
+    if (err == 0 && pArchive->numParts > 0)
+        LOGI("Opening split zip '%s' (%u parts, %lld bytes)\n", fileName,
+                pArchive->numParts, start);
+    return err;
+}
+
 /*
  * Open a Zip archive and scan out the contents.
  *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * The easiest way to do this is to mmap() the whole thing, so entry data
+ * can be handed out of the mapping.  With "dirOnly", or if that fails
+ * (a package of several GB won't fit in a 32-bit address space), only
+ * the central directory is read in and entry data is read with pread().
+ * Either way only the tail of the file and the central directory are
+ * touched here.
+ *
+ * If "indexPath" isn't NULL, the index saved there is used if it matches
+ * the archive, and rewritten after parsing if it doesn't.
  *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
@@ -427,15 +1469,27 @@ bail:
  *
  * On success, we fill out the contents of "pArchive".
  */
-int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+static int openZipArchive(const char* fileName, ZipArchive* pArchive,
+    bool dirOnly, const char* indexPath)
 {
     MemMapping map;
+    long long fileLength, mtime = 0;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
     map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
+
+    err = openZipParts(fileName, pArchive, &fileLength);
+    if (err != 0)
+        goto bail;
+    if (pArchive->numParts > 0) {
+        /* the parts can't be mapped as one */
+        dirOnly = true;
+        goto opened;
+    }
 
     pArchive->fd = open(fileName, O_RDONLY, 0);
     if (pArchive->fd < 0) {
@@ -444,27 +1498,58 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
-        err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+    fileLength = lseek64(pArchive->fd, 0, SEEK_END);
+    if (fileLength < 0 || lseek64(pArchive->fd, 0, SEEK_SET) != 0) {
+        err = errno ? errno : -1;
+        LOGV("Unable to seek '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
 
-    if (map.length < ENDHDR) {
+opened:
+    if (fileLength < ENDHDR) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName, fileLength);
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!dirOnly && sysMapFileInShmem(pArchive->fd, &map) != 0) {
+        LOGW("Map of '%s' failed; reading just its directory\n", fileName);
+    }
+
+    if (indexPath != NULL) {
+        struct stat sb;
+
+        /* (a split archive goes by the part with the directory) */
+        if (fstat(pArchive->numParts > 0 ?
+                pArchive->parts[pArchive->numParts - 1].fd : pArchive->fd,
+                &sb) == 0)
+            mtime = sb.st_mtime;
+        if (loadZipIndex(pArchive, map.addr != NULL ? &map : NULL,
+                fileLength, mtime, indexPath))
+        {
+            LOGV("Using archive index %s\n", indexPath);
+            indexPath = NULL;
+            goto done;
+        }
+    }
+
+    if (!parseZipArchive(pArchive, map.addr != NULL ? &map : NULL,
+            fileLength))
+    {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
     }
+    if (indexPath != NULL)
+        saveZipIndex(pArchive, fileLength, mtime, indexPath);
+
+done:
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
+    if (map.addr != NULL) {
+        sysCopyMap(&pArchive->map, &map);
+        map.addr = NULL;
+    }
 
 bail:
     if (err != 0)
@@ -474,6 +1559,22 @@ bail:
     return err;
 }
 
+int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, pArchive, false, NULL);
+}
+
+int mzOpenZipArchiveDirOnly(const char* fileName, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, pArchive, true, NULL);
+}
+
+int mzOpenZipArchiveIndexed(const char* fileName, const char* indexPath,
+    bool dirOnly, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, pArchive, dirOnly, indexPath);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -481,20 +1582,29 @@ bail:
  */
 void mzCloseZipArchive(ZipArchive* pArchive)
 {
+    unsigned int i;
+
     LOGV("Closing archive %p\n", pArchive);
 
     if (pArchive->fd >= 0)
         close(pArchive->fd);
+    for (i = 0; i < pArchive->numParts; i++)
+        close(pArchive->parts[i].fd);
+    free(pArchive->parts);
     if (pArchive->map.addr != NULL)
         sysReleaseShmem(&pArchive->map);
 
     free(pArchive->pEntries);
-
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pNameIndex);
+    free(pArchive->dirBuf);
 
     pArchive->fd = -1;
-    pArchive->pHash = NULL;
+    pArchive->parts = NULL;
+    pArchive->numParts = 0;
+    pArchive->pNameIndex = NULL;
     pArchive->pEntries = NULL;
+    pArchive->centralDir = NULL;
+    pArchive->dirBuf = NULL;
 }
 
 /*
@@ -503,409 +1613,2356 @@ void mzCloseZipArchive(ZipArchive* pArchive)
  * Returns NULL if no matching entry found.
  */
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
-        const char* entryName)
+        const char* name)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(name);
+    int index;
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+    index = lookupName(pArchive, name, nameLen, computeHash(name, nameLen),
+            NULL);
+    return index < 0 ? NULL : &pArchive->pEntries[index];
 }
 
+#ifdef MINZIP_BENCHMARK
 /*
- * Return true if the entry is a symbolic link.
+ * A name in the comparison table built by mzDumpZipNameIndexStats().
+ */
+typedef struct {
+    const char* name;
+    unsigned int nameLen;
+} ZipNameKey;
+
+/*
+ * The hash minzip used before the name index, kept for comparison.
  */
-bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
+static unsigned int computeOldHash(const char* name, unsigned int nameLen)
 {
-    if ((pEntry->versionMadeBy & 0xff00) == CENVEM_UNIX) {
-        return S_ISLNK(pEntry->externalFileAttributes >> 16);
-    }
-    return false;
+    unsigned int hash = 2;
+
+    while (nameLen--)
+        hash = hash * 31 + *name++;
+
+    return hash;
 }
 
-/* Call processFunction on the uncompressed data of a STORED entry.
+/*
+ * (This is a mzHashTableProbeCount callback.)
  */
-static bool processStoredEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+static unsigned int hashcalcZipNameKey(const void* vkey)
 {
-    size_t bytesLeft = pEntry->compLen;
-    while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
-        }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
-            return false;
-        }
-        bytesLeft -= count;
-    }
-    return true;
+    const ZipNameKey* key = (const ZipNameKey*) vkey;
+    return computeOldHash(key->name, key->nameLen);
 }
 
-static bool processDeflatedEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+/*
+ * (This is a mzHashTableLookup callback.)
+ */
+static int hashcmpZipNameKey(const void* vkey1, const void* vkey2)
 {
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
-    z_stream zstream;
-    int zerr;
-    long compRemaining;
+    const ZipNameKey* key1 = (const ZipNameKey*) vkey1;
+    const ZipNameKey* key2 = (const ZipNameKey*) vkey2;
 
-    compRemaining = pEntry->compLen;
+    if (key1->nameLen != key2->nameLen)
+        return key1->nameLen - key2->nameLen;
+    return memcmp(key1->name, key2->name, key1->nameLen);
+}
 
-    /*
-     * Initialize the zlib stream.
-     */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
-    zstream.data_type = Z_UNKNOWN;
+#define NAME_INDEX_TIMING_PASSES 4
 
-    /*
-     * Use the undocumented "negative window bits" feature to tell zlib
-     * that there's no zlib header waiting for it.
-     */
-    zerr = inflateInit2(&zstream, -MAX_WBITS);
-    if (zerr != Z_OK) {
-        if (zerr == Z_VERSION_ERROR) {
-            LOGE("Installed zlib is not compatible with linked version (%s)\n",
-                ZLIB_VERSION);
-        } else {
-            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
-        }
-        goto bail;
+/*
+ * Log probe lengths and lookup times for the name index, then for a
+ * HashTable holding the same names.
+ */
+void mzDumpZipNameIndexStats(const ZipArchive* pArchive)
+{
+    unsigned int i, numEntries = pArchive->numEntries;
+    int minProbe, maxProbe, totalProbe, pass, wrong;
+    struct timespec start, end;
+    long long elapsedNs, oldElapsedNs;
+    ZipNameKey* keys;
+    HashTable* pHash;
+
+    keys = (ZipNameKey*) malloc(numEntries * sizeof(ZipNameKey));
+    pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
+    if (keys == NULL || pHash == NULL) {
+        LOGW("Can't allocate name index statistics\n");
+        free(keys);
+        mzHashTableFree(pHash);
+        return;
     }
 
-    /*
-     * Loop while we have data.
-     */
-    do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
+    minProbe = INT_MAX;
+    maxProbe = totalProbe = 0;
+    for (i = 0; i < numEntries; i++) {
+        int probes;
+
+        keys[i].name = entryName(pArchive, &pArchive->pEntries[i]);
+        keys[i].nameLen = pArchive->pEntries[i].fileNameLen;
+        lookupName(pArchive, keys[i].name, keys[i].nameLen,
+                computeHash(keys[i].name, keys[i].nameLen), &probes);
+        if (probes < minProbe)
+            minProbe = probes;
+        if (probes > maxProbe)
+            maxProbe = probes;
+        totalProbe += probes;
+
+        mzHashTableLookup(pHash, computeOldHash(keys[i].name, keys[i].nameLen),
+                &keys[i], hashcmpZipNameKey, true);
+    }
 
-        /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
-            goto z_bail;
+    /* Time both tables looking the names up in the same (entry) order.
+     */
+    wrong = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (pass = 0; pass < NAME_INDEX_TIMING_PASSES; pass++) {
+        for (i = 0; i < numEntries; i++) {
+            if (mzHashTableLookup(pHash,
+                    computeOldHash(keys[i].name, keys[i].nameLen), &keys[i],
+                    hashcmpZipNameKey, false) == NULL)
+                wrong++;
         }
-
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
-        {
-            long procSize = zstream.next_out - procBuf;
-            LOGVV("+++ processing %d bytes\n", (int) procSize);
-            bool ret = processFunction(procBuf, procSize, cookie);
-            if (!ret) {
-                LOGW("Process function elected to fail (in inflate)\n");
-                goto z_bail;
-            }
-
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    oldElapsedNs = (end.tv_sec - start.tv_sec) * 1000000000LL +
+            (end.tv_nsec - start.tv_nsec);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (pass = 0; pass < NAME_INDEX_TIMING_PASSES; pass++) {
+        for (i = 0; i < numEntries; i++) {
+            if (lookupName(pArchive, keys[i].name, keys[i].nameLen,
+                    computeHash(keys[i].name, keys[i].nameLen), NULL) < 0)
+                wrong++;
         }
-    } while (zerr == Z_OK);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsedNs = (end.tv_sec - start.tv_sec) * 1000000000LL +
+            (end.tv_nsec - start.tv_nsec);
+    if (wrong != 0)
+        LOGW("Name index: %d lookups failed\n", wrong);
+
+    LOGI("Name index: min=%d max=%d, total=%d in %u (%u), avg=%.3f, %.1f ns/lookup\n",
+        minProbe, maxProbe, totalProbe, numEntries,
+        pArchive->nameIndexMask + 1,
+        numEntries ? (float) totalProbe / (float) numEntries : 0.0f,
+        numEntries ? (double) elapsedNs / numEntries /
+                NAME_INDEX_TIMING_PASSES : 0.0);
+    LOGI("HashTable: %.1f ns/lookup in entry order\n",
+        numEntries ? (double) oldElapsedNs / numEntries /
+                NAME_INDEX_TIMING_PASSES : 0.0);
+    mzHashTableProbeCount(pHash, hashcalcZipNameKey, hashcmpZipNameKey);
+
+    mzHashTableFree(pHash);
+    free(keys);
+}
+#endif /* MINZIP_BENCHMARK */
 
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
+/*
+ * Get the name of an entry.  It is not null-terminated.
+ */
+UnterminatedString mzGetZipEntryFileName(const ZipArchive* pArchive,
+    const ZipEntry* pEntry)
+{
+    UnterminatedString ret;
+    ret.str = entryName(pArchive, pEntry);
+    ret.len = pEntry->fileNameLen;
+    return ret;
+}
 
-    // success!
-    result = zstream.total_out;
+/*
+ * Get the DOS-format modification time of an entry.
+ */
+long mzGetZipEntryModTime(const ZipArchive* pArchive, const ZipEntry* pEntry)
+{
+    return get4LE(entryRecord(pArchive, pEntry) + CENTIM);
+}
 
-z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
+/*
+ * Return true if the entry is a symbolic link.
+ */
+bool mzIsZipEntrySymlink(const ZipArchive* pArchive, const ZipEntry* pEntry)
+{
+    const unsigned char* rec = entryRecord(pArchive, pEntry);
 
-bail:
-    if (result != pEntry->uncompLen) {
-        if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
+    if ((get2LE(rec + CENVEM) & 0xff00) == CENVEM_UNIX) {
+        return S_ISLNK(get4LE(rec + CENATX) >> 16);
+    }
+    return false;
+}
+
+/*
+ * Size of the slices of the archive mapping we hand to the process
+ * function.  Data is passed straight out of the mapping, so this only
+ * bounds how much gets faulted in per callback.
+ */
+#define MAPPED_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Find where the data of "pEntry" starts.  If the entries hold local
+ * header offsets (only the central directory was read when the archive
+ * was opened), read the local header now; the data usually starts in the
+ * same page anyway.
+ */
+static bool getEntryDataOffset(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, long long *pOffset)
+{
+    unsigned char buf[LOCHDR];
+    const unsigned char* localHdr = buf;
+
+    if (!pArchive->headerOffsets) {
+        *pOffset = pEntry->offset;
+        return true;
+    }
+    if (pArchive->map.addr != NULL) {
+        if (pArchive->map.length < LOCHDR || pEntry->offset < 0 ||
+            (unsigned long long)pEntry->offset > pArchive->map.length - LOCHDR)
+        {
+            LOGW("Bad offset to local header for '%.*s'\n",
+                    pEntry->fileNameLen, entryName(pArchive, pEntry));
+            return false;
+        }
+        localHdr = (const unsigned char*)pArchive->map.addr + pEntry->offset;
+    } else if (!archivePread(pArchive, buf, sizeof(buf), pEntry->offset)) {
+        return false;
+    }
+    if (get4LE(localHdr) != LOCSIG) {
+        LOGW("Missed a local header sig for '%.*s'\n", pEntry->fileNameLen,
+                entryName(pArchive, pEntry));
         return false;
     }
+    *pOffset = pEntry->offset + LOCHDR + get2LE(localHdr + LOCNAM)
+        + get2LE(localHdr + LOCEXT);
     return true;
 }
 
 /*
- * Stream the uncompressed data through the supplied function,
- * passing cookie to it each time it gets called.  processFunction
- * may be called more than once.
- *
- * If processFunction returns false, the operation is abandoned and
- * mzProcessZipEntryContents() immediately returns false.
+ * Return a pointer to the compressed data of "pEntry" within the archive
+ * mapping, or NULL if the archive isn't mapped or the entry's data lies
+ * outside the mapped region.  Callers fall back to pread() in that case.
+ */
+static const unsigned char* getMappedEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    long long offset;
+
+    if (pArchive->map.addr == NULL)
+        return NULL;
+    if (!getEntryDataOffset(pArchive, pEntry, &offset))
+        return NULL;
+    if (offset < 0 || pEntry->compLen < 0 ||
+        (unsigned long long)offset > pArchive->map.length ||
+        (unsigned long long)pEntry->compLen > pArchive->map.length - offset)
+    {
+        return NULL;
+    }
+    return (const unsigned char*)pArchive->map.addr + offset;
+}
+
+/*
+ * Decompressor state for a ZipEntryReader.  Kept out of Zip.h so callers
+ * don't need the codec headers.
+ */
+struct ZipCodec;
+typedef struct {
+    const struct ZipCodec* codec;
+    bool            done;
+    const unsigned char* in;        // compressed data not consumed yet
+    size_t          inLen;
+    union {
+        z_stream    zstream;
+#ifdef MINZIP_HAVE_ZSTD
+        ZSTD_DStream* zstd;
+#endif
+#ifdef MINZIP_HAVE_LZ4
+        LZ4F_dctx*  lz4;
+#endif
+    } u;
+    unsigned char   readBuf[32 * 1024];
+} ZipInflater;
+
+/*
+ * A streaming decompressor for one compression method.  decode() turns
+ * as much of pInflater->in as it can into at most "outLen" bytes at
+ * "out", advancing "in", and sets *pProduced.  It returns 1 at the end
+ * of the compressed stream, 0 if there's more to come, or -1 on error.
+ */
+typedef struct ZipCodec {
+    unsigned int method;
+    bool (*init)(ZipInflater* pInflater);
+    int (*decode)(ZipInflater* pInflater, unsigned char* out, size_t outLen,
+            size_t* pProduced);
+    void (*end)(ZipInflater* pInflater);
+} ZipCodec;
+
+static bool zlibCodecInit(ZipInflater* pInflater)
+{
+    int zerr;
+
+    memset(&pInflater->u.zstream, 0, sizeof(pInflater->u.zstream));
+    pInflater->u.zstream.zalloc = Z_NULL;
+    pInflater->u.zstream.zfree = Z_NULL;
+    pInflater->u.zstream.opaque = Z_NULL;
+    pInflater->u.zstream.next_in = NULL;
+    pInflater->u.zstream.avail_in = 0;
+    pInflater->u.zstream.data_type = Z_UNKNOWN;
+
+    /*
+     * Use the undocumented "negative window bits" feature to tell zlib
+     * that there's no zlib header waiting for it.
+     */
+    zerr = inflateInit2(&pInflater->u.zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        if (zerr == Z_VERSION_ERROR) {
+            LOGE("Installed zlib is not compatible with linked version (%s)\n",
+                ZLIB_VERSION);
+        } else {
+            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        }
+        return false;
+    }
+    return true;
+}
+
+static int zlibCodecDecode(ZipInflater* pInflater, unsigned char* out,
+    size_t outLen, size_t* pProduced)
+{
+    z_stream* pStream = &pInflater->u.zstream;
+    int zerr;
+
+    pStream->next_in = (Bytef*) pInflater->in;
+    pStream->avail_in = pInflater->inLen > UINT_MAX ? UINT_MAX :
+            pInflater->inLen;
+    pStream->next_out = (Bytef*) out;
+    pStream->avail_out = outLen > UINT_MAX ? UINT_MAX : outLen;
+
+    zerr = inflate(pStream, Z_NO_FLUSH);
+
+    *pProduced = (unsigned char*) pStream->next_out - out;
+    pInflater->inLen -= (const unsigned char*) pStream->next_in -
+            pInflater->in;
+    pInflater->in = (const unsigned char*) pStream->next_in;
+    if (zerr == Z_STREAM_END)
+        return 1;
+    if (zerr != Z_OK) {
+        LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+        return -1;
+    }
+    return 0;
+}
+
+static void zlibCodecEnd(ZipInflater* pInflater)
+{
+    inflateEnd(&pInflater->u.zstream);  /* free up any allocated structures */
+}
+
+#ifdef MINZIP_HAVE_ZSTD
+static bool zstdCodecInit(ZipInflater* pInflater)
+{
+    pInflater->u.zstd = ZSTD_createDStream();
+    if (pInflater->u.zstd == NULL) {
+        LOGE("Can't create zstd stream\n");
+        return false;
+    }
+    return true;
+}
+
+static int zstdCodecDecode(ZipInflater* pInflater, unsigned char* out,
+    size_t outLen, size_t* pProduced)
+{
+    ZSTD_inBuffer in = { pInflater->in, pInflater->inLen, 0 };
+    ZSTD_outBuffer output = { out, outLen, 0 };
+    size_t ret;
+
+    ret = ZSTD_decompressStream(pInflater->u.zstd, &output, &in);
+    *pProduced = output.pos;
+    pInflater->in += in.pos;
+    pInflater->inLen -= in.pos;
+    if (ZSTD_isError(ret)) {
+        LOGD("zstd decompress failed: %s\n", ZSTD_getErrorName(ret));
+        return -1;
+    }
+    if (ret == 0)
+        return 1;       /* end of the frame */
+    if (in.pos == 0 && output.pos == 0)
+        return -1;      /* out of input mid-frame */
+    return 0;
+}
+
+static void zstdCodecEnd(ZipInflater* pInflater)
+{
+    ZSTD_freeDStream(pInflater->u.zstd);
+}
+#endif
+
+#ifdef MINZIP_HAVE_LZ4
+static bool lz4CodecInit(ZipInflater* pInflater)
+{
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&pInflater->u.lz4,
+            LZ4F_VERSION))) {
+        LOGE("Can't create LZ4 decompression context\n");
+        return false;
+    }
+    return true;
+}
+
+static int lz4CodecDecode(ZipInflater* pInflater, unsigned char* out,
+    size_t outLen, size_t* pProduced)
+{
+    size_t inLen = pInflater->inLen;
+    size_t ret;
+
+    *pProduced = outLen;
+    ret = LZ4F_decompress(pInflater->u.lz4, out, pProduced, pInflater->in,
+            &inLen, NULL);
+    pInflater->in += inLen;
+    pInflater->inLen -= inLen;
+    if (LZ4F_isError(ret)) {
+        LOGD("LZ4 decompress failed: %s\n", LZ4F_getErrorName(ret));
+        *pProduced = 0;
+        return -1;
+    }
+    if (ret == 0)
+        return 1;       /* end of the frame */
+    if (inLen == 0 && *pProduced == 0)
+        return -1;      /* out of input mid-frame */
+    return 0;
+}
+
+static void lz4CodecEnd(ZipInflater* pInflater)
+{
+    LZ4F_freeDecompressionContext(pInflater->u.lz4);
+}
+#endif
+
+static const ZipCodec kZipCodecs[] = {
+    { DEFLATED, zlibCodecInit, zlibCodecDecode, zlibCodecEnd },
+#ifdef MINZIP_HAVE_ZSTD
+    { ZSTD, zstdCodecInit, zstdCodecDecode, zstdCodecEnd },
+#endif
+#ifdef MINZIP_HAVE_LZ4
+    { LZ4, lz4CodecInit, lz4CodecDecode, lz4CodecEnd },
+#endif
+};
+
+static const ZipCodec* findZipCodec(unsigned int method)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(kZipCodecs) / sizeof(kZipCodecs[0]); i++) {
+        if (kZipCodecs[i].method == method)
+            return &kZipCodecs[i];
+    }
+    return NULL;
+}
+
+/*
+ * Prepare to stream the uncompressed contents of "pEntry".
+ */
+bool mzOpenZipEntryReader(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    ZipEntryReader *pReader)
+{
+    ZipInflater* pInflater;
+    const ZipCodec* codec = NULL;
+
+    memset(pReader, 0, sizeof(*pReader));
+    pReader->pArchive = pArchive;
+    pReader->pEntry = pEntry;
+    pReader->mapped = getMappedEntryData(pArchive, pEntry);
+    if (!getEntryDataOffset(pArchive, pEntry, &pReader->compOffset))
+        return false;
+    pReader->compRemaining = pEntry->compLen;
+
+    if (pEntry->compression == STORED)
+        return true;
+    codec = findZipCodec(pEntry->compression);
+    if (codec == NULL) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen,
+                entryName(pArchive, pEntry));
+        return false;
+    }
+
+    pInflater = (ZipInflater*) malloc(sizeof(*pInflater));
+    if (pInflater == NULL) {
+        LOGE("Can't allocate inflater for entry '%.*s'\n",
+                pEntry->fileNameLen, entryName(pArchive, pEntry));
+        return false;
+    }
+    pInflater->codec = codec;
+    pInflater->done = false;
+    pInflater->in = NULL;
+    pInflater->inLen = 0;
+    if (!codec->init(pInflater)) {
+        free(pInflater);
+        return false;
+    }
+
+    pReader->inflater = pInflater;
+    return true;
+}
+
+/*
+ * Copy the next chunk of a STORED entry into "buf".
+ */
+static long readStoredEntry(ZipEntryReader *pReader, unsigned char *buf,
+    long bufLen)
+{
+    long count = bufLen;
+    if (count > pReader->compRemaining)
+        count = pReader->compRemaining;
+    if (count == 0)
+        return 0;
+
+    if (pReader->mapped != NULL) {
+        memcpy(buf, pReader->mapped, count);
+        pReader->mapped += count;
+    } else if (!archivePread(pReader->pArchive, buf, count,
+                    pReader->compOffset)) {
+        return -1;
+    }
+    pReader->compOffset += count;
+    pReader->compRemaining -= count;
+    return count;
+}
+
+/*
+ * Decompress the next chunk of a compressed entry into "buf".
+ */
+static long readCompressedEntry(ZipEntryReader *pReader, unsigned char *buf,
+    long bufLen)
+{
+    ZipInflater* pInflater = (ZipInflater*) pReader->inflater;
+    long total = 0;
+
+    if (pInflater->done)
+        return 0;
+
+    while (total < bufLen) {
+        size_t produced;
+        int status;
+
+        /* refill the input when the codec has consumed all of it */
+        if (pInflater->inLen == 0 && pReader->compRemaining > 0) {
+            if (pReader->mapped != NULL) {
+                /* hand over the rest of the entry directly from the mapping */
+                size_t getSize = (pReader->compRemaining > (long long)SIZE_MAX)
+                            ? SIZE_MAX : pReader->compRemaining;
+
+                pInflater->in = pReader->mapped;
+                pInflater->inLen = getSize;
+                pReader->mapped += getSize;
+                pReader->compOffset += getSize;
+                pReader->compRemaining -= getSize;
+            } else {
+                unsigned int getSize = (pReader->compRemaining >
+                            (long long)sizeof(pInflater->readBuf)) ?
+                            sizeof(pInflater->readBuf) :
+                            pReader->compRemaining;
+                LOGVV("+++ reading %u bytes (%lld left)\n",
+                    getSize, pReader->compRemaining);
+
+                if (!archivePread(pReader->pArchive, pInflater->readBuf,
+                        getSize, pReader->compOffset)) {
+                    LOGW("inflate read failed (%u bytes)\n", getSize);
+                    return -1;
+                }
+                pInflater->in = pInflater->readBuf;
+                pInflater->inLen = getSize;
+                pReader->compOffset += getSize;
+                pReader->compRemaining -= getSize;
+            }
+        }
+
+        /* uncompress the data */
+        status = pInflater->codec->decode(pInflater, buf + total,
+                bufLen - total, &produced);
+        total += produced;
+        if (status < 0)
+            return -1;
+        if (status > 0) {
+            pInflater->done = true;
+            break;
+        }
+    }
+
+    /* zlib's total_out is only 32 bits wide on some targets, so keep
+     * our own count for entries over 4 GB.
+     */
+    pReader->uncompRead += total;
+    if (pReader->uncompRead > pReader->pEntry->uncompLen ||
+        (pInflater->done &&
+            pReader->uncompRead != pReader->pEntry->uncompLen))
+    {
+        LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+            pReader->uncompRead, pReader->pEntry->uncompLen);
+        return -1;
+    }
+
+    return total;
+}
+
+/*
+ * Read up to "bufLen" bytes of uncompressed data.
+ */
+long mzReadZipEntryReader(ZipEntryReader *pReader, unsigned char *buf,
+    long bufLen)
+{
+    if (pReader->inflater != NULL)
+        return readCompressedEntry(pReader, buf, bufLen);
+    return readStoredEntry(pReader, buf, bufLen);
+}
+
+/*
+ * Release the resources held by a reader.
+ */
+void mzCloseZipEntryReader(ZipEntryReader *pReader)
+{
+    ZipInflater* pInflater = (ZipInflater*) pReader->inflater;
+
+    if (pInflater != NULL) {
+        pInflater->codec->end(pInflater);
+        free(pInflater);
+    }
+    pReader->inflater = NULL;
+}
+
+/* Call processFunction on the uncompressed data of a STORED entry.
+ * If the entry is mapped, the function is handed slices of the mapping
+ * directly; otherwise the data is pread() into a bounce buffer.
+ */
+static bool processStoredEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    const unsigned char* mapped = getMappedEntryData(pArchive, pEntry);
+    long long bytesLeft = pEntry->compLen;
+    long long offset;
+
+    if (mapped != NULL) {
+        while (bytesLeft > 0) {
+            size_t count = MAPPED_CHUNK_SIZE;
+            if (bytesLeft < MAPPED_CHUNK_SIZE) {
+                count = bytesLeft;
+            }
+            if (!processFunction(mapped, count, cookie)) {
+                return false;
+            }
+            mapped += count;
+            bytesLeft -= count;
+        }
+        return true;
+    }
+
+    if (!getEntryDataOffset(pArchive, pEntry, &offset))
+        return false;
+    while (bytesLeft > 0) {
+        unsigned char buf[32 * 1024];
+        size_t count;
+        bool ret;
+
+        count = sizeof(buf);
+        if (bytesLeft < (long long)sizeof(buf)) {
+            count = bytesLeft;
+        }
+        if (!archivePread(pArchive, buf, count, offset)) {
+            return false;
+        }
+        ret = processFunction(buf, count, cookie);
+        if (!ret) {
+            return false;
+        }
+        offset += count;
+        bytesLeft -= count;
+    }
+    return true;
+}
+
+static long long elapsedNanos(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL +
+            (now.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Compressed entries at least this big are inflated on a separate thread,
+ * into a ring of PIPELINE_BUFFERS buffers of PIPELINE_BUFFER_SIZE bytes,
+ * while the calling thread hands the filled ones to processFunction.
+ * Inflating and writing out a big image then overlap instead of taking
+ * turns.
+ */
+#define PIPELINE_MIN_SIZE       (16 * 1024 * 1024)
+#define PIPELINE_BUFFERS        4
+#define PIPELINE_BUFFER_SIZE    (1024 * 1024)
+
+typedef struct {
+    ZipEntryReader  reader;
+    unsigned char*  bufs[PIPELINE_BUFFERS];
+    long            lens[PIPELINE_BUFFERS];
+    unsigned int    numFilled;      // total buffers filled by the inflater
+    unsigned int    numDrained;     // total handed to processFunction
+    bool            done;           // inflater finished, for good or ill
+    bool            failed;         // inflater hit an error
+    bool            aborted;        // processFunction failed; stop
+    long long       inflateNanos;   // time spent inflating
+    pthread_mutex_t lock;
+    pthread_cond_t  filled;
+    pthread_cond_t  drained;
+} InflatePipeline;
+
+static void* inflatePipelineThread(void* arg)
+{
+    InflatePipeline* pipeline = (InflatePipeline*) arg;
+    bool eof = false, failed = false;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (!eof && !failed) {
+        unsigned int slot;
+        struct timespec start;
+        long len = 0;
+
+        while (pipeline->numFilled - pipeline->numDrained == PIPELINE_BUFFERS &&
+                !pipeline->aborted) {
+            pthread_cond_wait(&pipeline->drained, &pipeline->lock);
+        }
+        if (pipeline->aborted)
+            break;
+        slot = pipeline->numFilled % PIPELINE_BUFFERS;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (len < PIPELINE_BUFFER_SIZE) {
+            long n = mzReadZipEntryReader(&pipeline->reader,
+                    pipeline->bufs[slot] + len, PIPELINE_BUFFER_SIZE - len);
+            if (n < 0) {
+                failed = true;
+                break;
+            }
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            len += n;
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->inflateNanos += elapsedNanos(&start);
+        if (len > 0 && !failed) {
+            pipeline->lens[slot] = len;
+            pipeline->numFilled++;
+        }
+        pthread_cond_signal(&pipeline->filled);
+    }
+    pipeline->failed = failed;
+    pipeline->done = true;
+    pthread_cond_signal(&pipeline->filled);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+/*
+ * Call processFunction on the uncompressed data of a compressed entry, in
+ * PIPELINE_BUFFER_SIZE pieces, with the inflating done on another
+ * thread.  processFunction is still only called from this one.
  *
- * This is useful for calculating the hash of an entry's uncompressed contents.
+ * Returns 1 on success, 0 on failure, or -1 if the pipeline couldn't be
+ * set up and the caller should process the entry itself.
  */
-bool mzProcessZipEntryContents(const ZipArchive *pArchive,
+static int processCompressedEntryPipelined(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    bool ret = false;
-    off_t oldOff;
+    InflatePipeline pipeline;
+    pthread_t thread;
+    struct timespec start;
+    long long processNanos = 0, totalNanos;
+    bool ok = true;
+    int result, i;
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    for (i = 0; i < PIPELINE_BUFFERS; i++) {
+        pipeline.bufs[i] = (unsigned char*) malloc(PIPELINE_BUFFER_SIZE);
+        if (pipeline.bufs[i] == NULL) {
+            while (--i >= 0)
+                free(pipeline.bufs[i]);
+            return -1;
+        }
+    }
+    if (!mzOpenZipEntryReader(pArchive, pEntry, &pipeline.reader)) {
+        result = 0;
+        goto bail;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.filled, NULL);
+    pthread_cond_init(&pipeline.drained, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_create(&thread, NULL, inflatePipelineThread, &pipeline) != 0) {
+        mzCloseZipEntryReader(&pipeline.reader);
+        result = -1;
+        goto destroy;
+    }
 
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
+    pthread_mutex_lock(&pipeline.lock);
+    while (true) {
+        unsigned int slot;
+        struct timespec procStart;
 
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
+        while (pipeline.numDrained == pipeline.numFilled && !pipeline.done)
+            pthread_cond_wait(&pipeline.filled, &pipeline.lock);
+        if (pipeline.numDrained == pipeline.numFilled)
+            break;
+        slot = pipeline.numDrained % PIPELINE_BUFFERS;
+        pthread_mutex_unlock(&pipeline.lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &procStart);
+        ok = processFunction(pipeline.bufs[slot], pipeline.lens[slot], cookie);
+        processNanos += elapsedNanos(&procStart);
+
+        pthread_mutex_lock(&pipeline.lock);
+        if (!ok) {
+            LOGW("Process function elected to fail (in inflate)\n");
+            pipeline.aborted = true;
+            pthread_cond_signal(&pipeline.drained);
+            break;
+        }
+        pipeline.numDrained++;
+        pthread_cond_signal(&pipeline.drained);
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+    pthread_join(thread, NULL);
+    totalNanos = elapsedNanos(&start);
+    mzCloseZipEntryReader(&pipeline.reader);
+
+    if (pipeline.failed)
+        ok = false;
+    result = ok ? 1 : 0;
+    if (ok) {
+        /* Time both sides were busy at once, as a share of the shorter
+         * side's busy time: 100% means one was completely hidden behind
+         * the other.
+         */
+        long long overlap = pipeline.inflateNanos + processNanos - totalNanos;
+        long long shorter = pipeline.inflateNanos < processNanos ?
+                pipeline.inflateNanos : processNanos;
+        if (overlap < 0)
+            overlap = 0;
+        LOGI("Pipelined %.*s: %lld ms, inflating %lld ms, processing %lld ms"
+                ", %lld%% overlap\n",
+                pEntry->fileNameLen, entryName(pArchive, pEntry),
+                totalNanos / 1000000, pipeline.inflateNanos / 1000000,
+                processNanos / 1000000,
+                shorter > 0 ? overlap * 100 / shorter : 0);
+    }
 
-    switch (pEntry->compression) {
-    case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    case DEFLATED:
-        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    default:
-        LOGE("Unsupported compression type %d for entry '%s'\n",
-                pEntry->compression, pEntry->fileName);
-        break;
-    }
-
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
-    return ret;
+destroy:
+    pthread_cond_destroy(&pipeline.drained);
+    pthread_cond_destroy(&pipeline.filled);
+    pthread_mutex_destroy(&pipeline.lock);
+bail:
+    for (i = 0; i < PIPELINE_BUFFERS; i++)
+        free(pipeline.bufs[i]);
+    return result;
 }
 
-static bool crcProcessFunction(const unsigned char *data, int dataLen,
-        void *crc)
-{
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
+/* Call processFunction on the uncompressed data of a compressed entry,
+ * 32 KB at a time, or through the pipeline above if it's big and
+ * "pipeline" allows it.
+ */
+static bool processCompressedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie, bool pipeline)
+{
+    unsigned char procBuf[32 * 1024];
+    ZipEntryReader reader;
+    bool ret = false;
+
+    if (pipeline && pEntry->uncompLen >= PIPELINE_MIN_SIZE) {
+        int result = processCompressedEntryPipelined(pArchive, pEntry,
+                processFunction, cookie);
+        if (result >= 0)
+            return result != 0;
+    }
+
+    if (!mzOpenZipEntryReader(pArchive, pEntry, &reader))
+        return false;
+
+    while (true) {
+        long procSize = mzReadZipEntryReader(&reader, procBuf,
+                sizeof(procBuf));
+        if (procSize < 0)
+            break;
+        if (procSize == 0) {
+            // success!
+            ret = true;
+            break;
+        }
+
+        LOGVV("+++ processing %d bytes\n", (int) procSize);
+        if (!processFunction(procBuf, procSize, cookie)) {
+            LOGW("Process function elected to fail (in inflate)\n");
+            break;
+        }
+    }
+
+    mzCloseZipEntryReader(&reader);
+    return ret;
+}
+
+/*
+ * Whole-buffer decompressor backends.
+ *
+ * When a DEFLATED entry is mapped and the caller has a buffer of exactly
+ * uncompLen bytes, there's no need to stream: the whole entry can be
+ * inflated in one call, straight from the mapping into the buffer.  That
+ * avoids the 32 KB ping-pong and zlib's copies into its sliding window,
+ * and lets an engine that needs the whole input and output (libdeflate)
+ * be used at all.
+ *
+ * Each backend inflates "srcLen" bytes of raw deflate data into exactly
+ * "dstLen" bytes, and fails if the data doesn't produce exactly that.
+ */
+typedef struct {
+    const char* name;
+    bool (*inflateWhole)(const unsigned char* src, unsigned long long srcLen,
+            unsigned char* dst, unsigned long long dstLen);
+} InflateBackend;
+
+/*
+ * zlib, fed the whole input and output at once.  With Z_FINISH on the
+ * only call (or the last one, for entries over 4GB), zlib never sets up
+ * a sliding window and decodes with inflate_fast() throughout.
+ */
+static bool zlibInflateWhole(const unsigned char* src, unsigned long long srcLen,
+    unsigned char* dst, unsigned long long dstLen)
+{
+    z_stream zstream;
+    unsigned char empty;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+
+    /* inflate() rejects a NULL next_out even with nothing to write, as
+     * for an empty entry.
+     */
+    zstream.next_out = &empty;
+    do {
+        if (zstream.avail_in == 0 && srcLen > 0) {
+            uInt chunk = srcLen > UINT_MAX ? UINT_MAX : srcLen;
+            zstream.next_in = (Bytef*) src;
+            zstream.avail_in = chunk;
+            src += chunk;
+            srcLen -= chunk;
+        }
+        if (zstream.avail_out == 0 && dstLen > 0) {
+            uInt chunk = dstLen > UINT_MAX ? UINT_MAX : dstLen;
+            zstream.next_out = dst;
+            zstream.avail_out = chunk;
+            dst += chunk;
+            dstLen -= chunk;
+        }
+        zerr = inflate(&zstream,
+                (srcLen == 0 && dstLen == 0) ? Z_FINISH : Z_NO_FLUSH);
+    } while (zerr == Z_OK);
+
+    inflateEnd(&zstream);
+    if (zerr != Z_STREAM_END || zstream.avail_out != 0 || dstLen != 0) {
+        LOGW("Whole-buffer inflate failed (zerr=%d, %u+%llu bytes short)\n",
+            zerr, zstream.avail_out, dstLen);
+        return false;
+    }
+    return true;
+}
+
+#ifdef MINZIP_USE_LIBDEFLATE
+/*
+ * libdeflate, which decodes whole buffers only and is several times
+ * faster than zlib at it.
+ */
+static bool libdeflateInflateWhole(const unsigned char* src,
+    unsigned long long srcLen, unsigned char* dst, unsigned long long dstLen)
+{
+    struct libdeflate_decompressor* d;
+    enum libdeflate_result result;
+
+    if (srcLen > SIZE_MAX || dstLen > SIZE_MAX)
+        return zlibInflateWhole(src, srcLen, dst, dstLen);
+
+    d = libdeflate_alloc_decompressor();
+    if (d == NULL) {
+        LOGE("Can't allocate libdeflate decompressor\n");
+        return false;
+    }
+    /* no "actual size" pointer: anything but exactly dstLen is an error */
+    result = libdeflate_deflate_decompress(d, src, srcLen, dst, dstLen, NULL);
+    libdeflate_free_decompressor(d);
+    if (result != LIBDEFLATE_SUCCESS) {
+        LOGW("libdeflate failed (result=%d)\n", (int) result);
+        return false;
+    }
+    return true;
+}
+
+static const InflateBackend gInflateBackend = {
+    "libdeflate", libdeflateInflateWhole
+};
+#else
+static const InflateBackend gInflateBackend = {
+    "zlib", zlibInflateWhole
+};
+#endif
+
+/*
+ * Stream the uncompressed data through the supplied function,
+ * passing cookie to it each time it gets called.  processFunction
+ * may be called more than once.
+ *
+ * If processFunction returns false, the operation is abandoned and
+ * mzProcessZipEntryContents() immediately returns false.
+ *
+ * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * All reads are positional (mapping or pread()), so this never moves
+ * the archive's file offset and may run on several threads at once.
+ *
+ * Without "pipeline", big compressed entries are inflated on the calling
+ * thread too; the extraction workers use that, as they already keep
+ * every CPU busy.
+ */
+static bool processZipEntryContents(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie, bool pipeline)
+{
+    bool ret = false;
+
+    if (pEntry->compression == STORED) {
+        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
+    } else if (findZipCodec(pEntry->compression) != NULL) {
+        ret = processCompressedEntry(pArchive, pEntry, processFunction,
+                cookie, pipeline);
+    } else {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen,
+                entryName(pArchive, pEntry));
+    }
+
+    return ret;
+}
+
+bool mzProcessZipEntryContents(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    return processZipEntryContents(pArchive, pEntry, processFunction, cookie,
+            true);
+}
+
+typedef struct {
+    ProcessZipEntryContentsFunction processFunction;
+    void *cookie;
+    unsigned long crc;
+} CrcProcessArgs;
+
+/*
+ * Compare the CRC of the data we produced with the one in the central
+ * directory.
+ */
+static bool checkEntryCrc(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    unsigned long crc)
+{
+    if (crc != pEntry->crc32) {
+        LOGE("CRC for entry %.*s (0x%08lx) != expected (0x%08x)\n",
+                pEntry->fileNameLen, entryName(pArchive, pEntry), crc,
+                pEntry->crc32);
+        return false;
+    }
+    return true;
+}
+
+static bool crcProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    CrcProcessArgs *args = (CrcProcessArgs *)cookie;
+
+    args->crc = mzCrc32(args->crc, data, dataLen);
+    if (args->processFunction == NULL)
+        return true;
+    return args->processFunction(data, dataLen, args->cookie);
+}
+
+/*
+ * Like mzProcessZipEntryContents(), but also checksum the data on its
+ * way to processFunction (which may be NULL) and fail if it doesn't
+ * match the CRC in the central directory.  The data is still in cache
+ * from being inflated or read, so this costs far less than a separate
+ * pass.  processFunction will have seen all of the data by the time a
+ * mismatch is reported.  "pipeline" is as for processZipEntryContents().
+ */
+static bool processZipEntryContentsVerified(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie, bool pipeline)
+{
+    CrcProcessArgs args;
+
+    args.processFunction = processFunction;
+    args.cookie = cookie;
+    args.crc = 0;
+    if (!processZipEntryContents(pArchive, pEntry, crcProcessFunction,
+            (void *)&args, pipeline)) {
+        return false;
+    }
+    return checkEntryCrc(pArchive, pEntry, args.crc);
+}
+
+/*
+ * Check the CRC on this entry; return true if it is correct.
+ * May do other internal checks as well.
+ */
+bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
+{
+    return processZipEntryContentsVerified(pArchive, pEntry, NULL, NULL, true);
+}
+
+typedef struct {
+    unsigned char* buffer;
+    long long len;
+} BufferExtractCookie;
+
+static bool bufferProcessFunction(const unsigned char *data, int dataLen,
+    void *cookie) {
+    BufferExtractCookie *bec = (BufferExtractCookie*)cookie;
+
+    if (dataLen > bec->len) {
+        LOGE("Entry data overruns its buffer\n");
+        return false;
+    }
+    memmove(bec->buffer, data, dataLen);
+    bec->buffer += dataLen;
+    bec->len -= dataLen;
+
+    return true;
+}
+
+/*
+ * Uncompress all of "pEntry" into "buffer", which holds exactly
+ * uncompLen bytes, and check its CRC.  Mapped DEFLATED (and zstd)
+ * entries are decompressed by a whole-buffer call; everything else is
+ * streamed.
+ */
+static bool extractEntryToExactBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer)
+{
+    const unsigned char* mapped = getMappedEntryData(pArchive, pEntry);
+    BufferExtractCookie bec;
+
+    if (mapped != NULL && pEntry->compression == DEFLATED) {
+        if (!gInflateBackend.inflateWhole(mapped, pEntry->compLen,
+                buffer, pEntry->uncompLen)) {
+            return false;
+        }
+        return checkEntryCrc(pArchive, pEntry,
+                mzCrc32(0, buffer, pEntry->uncompLen));
+    }
+#ifdef MINZIP_HAVE_ZSTD
+    if (mapped != NULL && pEntry->compression == ZSTD) {
+        size_t ret = ZSTD_decompress(buffer, pEntry->uncompLen, mapped,
+                pEntry->compLen);
+        if (ZSTD_isError(ret) || ret != (size_t) pEntry->uncompLen) {
+            LOGW("zstd decompress failed: %s\n", ZSTD_isError(ret) ?
+                    ZSTD_getErrorName(ret) : "size mismatch");
+            return false;
+        }
+        return checkEntryCrc(pArchive, pEntry,
+                mzCrc32(0, buffer, pEntry->uncompLen));
+    }
+#endif
+
+    bec.buffer = buffer;
+    bec.len = pEntry->uncompLen;
+    return processZipEntryContentsVerified(pArchive, pEntry,
+            bufferProcessFunction, (void*)&bec, true) && bec.len == 0;
+}
+
+typedef struct {
+    char *buf;
+    int bufLen;
+} CopyProcessArgs;
+
+static bool copyProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
+    if (dataLen <= args->bufLen) {
+        memcpy(args->buf, data, dataLen);
+        args->buf += dataLen;
+        args->bufLen -= dataLen;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Read an entry into a buffer allocated by the caller, checking its CRC.
+ */
+bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        char *buf, int bufLen)
+{
+    CopyProcessArgs args;
+    bool ret;
+
+    if (bufLen >= 0 && pEntry->uncompLen <= bufLen) {
+        ret = extractEntryToExactBuffer(pArchive, pEntry,
+                (unsigned char *)buf);
+    } else {
+        args.buf = buf;
+        args.bufLen = bufLen;
+        ret = processZipEntryContentsVerified(pArchive, pEntry,
+                copyProcessFunction, (void *)&args, true);
+    }
+    if (!ret) {
+        LOGE("Can't extract entry to buffer.\n");
+        return false;
+    }
+    return true;
+}
+
+static bool writeProcessFunction(const unsigned char *data, int dataLen,
+                                 void *cookie)
+{
+    int fd = (int)cookie;
+
+    ssize_t soFar = 0;
+    while (true) {
+        ssize_t n = write(fd, data+soFar, dataLen-soFar);
+        if (n <= 0) {
+            LOGE("Error writing %ld bytes from zip file from %p: %s\n",
+                 dataLen-soFar, data+soFar, strerror(errno));
+            if (errno != EINTR) {
+              return false;
+            }
+        } else if (n > 0) {
+            soFar += n;
+            if (soFar == dataLen) return true;
+            if (soFar > dataLen) {
+                LOGE("write overrun?  (%ld bytes instead of %d)\n",
+                     soFar, dataLen);
+                return false;
+            }
+        }
+    }
+}
+
+/*
+ * The streaming decoders hand over 32 KB at a time; collect that into
+ * writes of this size, so each file takes a few large writes instead of
+ * many small ones.
+ */
+#define WRITE_BUFFER_SIZE       (256 * 1024)
+
+typedef struct {
+    int             fd;
+    unsigned char*  buf;
+    size_t          len;
+    size_t          size;
+} BufferedWriter;
+
+static bool flushBufferedWriter(BufferedWriter *writer)
+{
+    bool ok = true;
+
+    if (writer->len > 0) {
+        ok = writeProcessFunction(writer->buf, writer->len,
+                (void*) writer->fd);
+        writer->len = 0;
+    }
+    return ok;
+}
+
+static bool bufferedWriteFunction(const unsigned char *data, int dataLen,
+                                  void *cookie)
+{
+    BufferedWriter *writer = (BufferedWriter*) cookie;
+
+    if (writer->len + dataLen > writer->size) {
+        if (!flushBufferedWriter(writer))
+            return false;
+        if ((size_t) dataLen >= writer->size) {
+            return writeProcessFunction(data, dataLen, (void*) writer->fd);
+        }
+    }
+    memcpy(writer->buf + writer->len, data, dataLen);
+    writer->len += dataLen;
+    return true;
+}
+
+/*
+ * Stream the uncompressed data of "pEntry" to "fd", checking its CRC,
+ * in writes of up to WRITE_BUFFER_SIZE bytes.  "pipeline" is as for
+ * processZipEntryContents().
+ */
+static bool writeCompressedEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd, bool pipeline)
+{
+    BufferedWriter writer;
+    bool ok;
+
+    /* Small entries come out in a single piece anyway, and the
+     * pipeline already hands big ones over in large buffers.
+     */
+    if (pEntry->uncompLen <= 32 * 1024 ||
+            (pipeline && pEntry->uncompLen >= PIPELINE_MIN_SIZE)) {
+        return processZipEntryContentsVerified(pArchive, pEntry,
+                writeProcessFunction, (void*)fd, pipeline);
+    }
+
+    writer.fd = fd;
+    writer.len = 0;
+    writer.size = pEntry->uncompLen < WRITE_BUFFER_SIZE ?
+            (size_t) pEntry->uncompLen : WRITE_BUFFER_SIZE;
+    writer.buf = (unsigned char*) malloc(writer.size);
+    if (writer.buf == NULL) {
+        return processZipEntryContentsVerified(pArchive, pEntry,
+                writeProcessFunction, (void*)fd, pipeline);
+    }
+    ok = processZipEntryContentsVerified(pArchive, pEntry,
+            bufferedWriteFunction, &writer, pipeline);
+    if (ok)
+        ok = flushBufferedWriter(&writer);
+    free(writer.buf);
+    return ok;
+}
+
+/*
+ * How much of a STORED entry to hand the kernel per copy call; the CRC
+ * is computed a piece at a time behind it, while the data is in cache.
+ */
+#define KERNEL_COPY_CHUNK (1024 * 1024)
+
+/*
+ * True if a kernel copy failed because it can't be done for these files
+ * (old kernel, different filesystems, O_APPEND destination, ...), rather
+ * than because of an I/O error.
+ */
+static bool kernelCopyUnsupported(int err)
+{
+    return err == ENOSYS || err == EINVAL || err == EXDEV ||
+            err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * Copy up to "count" bytes at "*pOffset" in "inFd" to the current offset
+ * of "outFd" without bringing them into user space, and advance *pOffset.
+ * copy_file_range() is tried first, unless "*pTryRange" is false; it can
+ * share extents on filesystems that support that.  Then sendfile().
+ *
+ * Returns the number of bytes copied, 0 if the kernel can't copy between
+ * these files, or -1 on error.
+ */
+static ssize_t kernelCopy(int inFd, long long *pOffset, int outFd,
+    size_t count, bool *pTryRange)
+{
+    ssize_t n;
+    off_t off;
+
+#ifdef __NR_copy_file_range
+    if (*pTryRange) {
+        long long rangeOff = *pOffset;      /* a loff_t to the kernel */
+
+        do {
+            n = syscall(__NR_copy_file_range, inFd, &rangeOff, outFd, NULL,
+                    count, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) {
+            *pOffset = rangeOff;
+            return n;
+        }
+        if (n == 0 || !kernelCopyUnsupported(errno))
+            goto fail;
+        *pTryRange = false;
+    }
+#else
+    (void) pTryRange;
+#endif
+
+    off = *pOffset;
+    if (off != *pOffset)
+        return 0;       /* a 32-bit off_t can't reach it */
+    do {
+        n = sendfile(outFd, inFd, &off, count);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        *pOffset = off;
+        return n;
+    }
+    if (n < 0 && kernelCopyUnsupported(errno))
+        return 0;
+
+fail:
+    LOGE("Can't copy %zu bytes from zip file at %lld: %s\n", count,
+            *pOffset, n < 0 ? strerror(errno) : "EOF");
+    return -1;
+}
+
+/*
+ * Write the STORED entry "pEntry" to "fd" at the current offset with
+ * kernel copies, checking its CRC.  The CRC is taken from the mapping,
+ * or read back with pread() (the pages are in cache from the copy).
+ * Anything the kernel won't copy goes through a buffer instead.
+ */
+static bool copyStoredEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    const unsigned char* mapped = getMappedEntryData(pArchive, pEntry);
+    unsigned char buf[32 * 1024];
+    long long dataOffset, offset, bytesLeft = pEntry->compLen;
+    unsigned long crc = 0;
+    bool useKernel = true, tryRange = true;
+
+    if (!getEntryDataOffset(pArchive, pEntry, &dataOffset))
+        return false;
+    offset = dataOffset;
+    while (bytesLeft > 0) {
+        long long start = offset;
+        size_t count;
+
+        if (useKernel) {
+            long long partOffset, partLeft;
+            int inFd;
+            ssize_t n;
+
+            /* a copy can't run past the end of a part of a split zip */
+            inFd = findArchivePart(pArchive, offset, &partOffset, &partLeft);
+            if (inFd < 0)
+                return false;
+            count = KERNEL_COPY_CHUNK;
+            if (bytesLeft < (long long) count)
+                count = bytesLeft;
+            if (partLeft < (long long) count)
+                count = partLeft;
+            n = kernelCopy(inFd, &partOffset, fd, count, &tryRange);
+            if (n < 0)
+                return false;
+            if (n == 0) {
+                useKernel = false;
+                continue;
+            }
+            count = n;
+            offset += count;
+            if (mapped != NULL) {
+                crc = mzCrc32(crc, mapped + (start - dataOffset), count);
+            } else {
+                while (start < offset) {
+                    size_t len = sizeof(buf);
+                    if (offset - start < (long long) len)
+                        len = offset - start;
+                    if (!archivePread(pArchive, buf, len, start))
+                        return false;
+                    crc = mzCrc32(crc, buf, len);
+                    start += len;
+                }
+            }
+        } else {
+            count = sizeof(buf);
+            if (bytesLeft < (long long) count)
+                count = bytesLeft;
+            if (!archivePread(pArchive, buf, count, offset) ||
+                    !writeFully(fd, buf, count)) {
+                return false;
+            }
+            crc = mzCrc32(crc, buf, count);
+            offset += count;
+        }
+        bytesLeft -= count;
+    }
+    return checkEntryCrc(pArchive, pEntry, crc);
+}
+
+/*
+ * Below this, mapping the destination costs more than the writes it
+ * saves.
+ */
+#define MAPPED_EXTRACT_MIN_SIZE (1024 * 1024)
+
+/*
+ * Inflate "pEntry" into "fd" at its current offset by preallocating the
+ * space (which also keeps the file contiguous), mapping it and inflating
+ * into the mapping, checking the CRC.  The file offset is left after the
+ * data, as if it had been written.
+ *
+ * Returns 1 on success and 0 on failure.  Returns -1 without writing
+ * anything if "fd" can't be used this way (not a regular file opened
+ * for reading and writing, or a kernel or filesystem that can't
+ * preallocate), and the caller should write() the data instead.  Either
+ * way, on failure the file is cut back to the size it had, so it isn't
+ * left full-size with zeroes or half-inflated data.
+ */
+static int inflateEntryIntoFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    struct stat sb;
+    long long start, mapStart, oldSize;
+    size_t adjust, mapLen;
+    void* map;
+    bool ok;
+
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+        return -1;
+    start = lseek64(fd, 0, SEEK_CUR);
+    if (start < 0)
+        return -1;
+    adjust = start % sysconf(_SC_PAGESIZE);
+    mapStart = start - adjust;
+    if ((off_t) mapStart != mapStart ||
+            (unsigned long long) pEntry->uncompLen > SIZE_MAX - adjust)
+        return -1;
+    mapLen = adjust + pEntry->uncompLen;
+    oldSize = sb.st_size > start ? sb.st_size : start;
+
+    /* Only map the file once its blocks are allocated.  Otherwise
+     * running out of space would show up as SIGBUS while inflating.
+     */
+    if (sysFallocate(fd, 0, start, pEntry->uncompLen) != 0) {
+        if (errno != ENOSYS && errno != EOPNOTSUPP) {
+            /* it may have allocated (and grown the file) part way */
+            LOGV("Can't preallocate %lld bytes (%s); writing instead\n",
+                    pEntry->uncompLen, strerror(errno));
+            ftruncate64(fd, oldSize);
+        }
+        return -1;
+    }
+    map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            (off_t) mapStart);
+    if (map == MAP_FAILED) {
+        LOGV("Can't map output (%s); writing instead\n", strerror(errno));
+        ftruncate64(fd, oldSize);
+        return -1;
+    }
+
+    ok = extractEntryToExactBuffer(pArchive, pEntry,
+            (unsigned char*) map + adjust);
+    if (munmap(map, mapLen) != 0)
+        ok = false;
+    if (ok && lseek64(fd, start + pEntry->uncompLen, SEEK_SET) < 0)
+        ok = false;
+    if (!ok)
+        ftruncate64(fd, oldSize);
+    return ok ? 1 : 0;
+}
+
+/*
+ * Smaller files fit in the filesystem's first allocation for them, so
+ * preallocating would only cost a system call.
+ */
+#define PREALLOCATE_MIN_SIZE    (64 * 1024)
+
+/*
+ * Uncompress "pEntry" in "pArchive" to "fd" at the current offset,
+ * checking its CRC.  STORED entries are copied by the kernel where it
+ * can, with no pass through user space.  With "mapOutput", large
+ * compressed ones are inflated into a mapping of the file if it can be
+ * mapped.  Without "pipeline", big compressed entries are inflated on
+ * the calling thread (see processZipEntryContents()).
+ */
+static bool extractEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd, bool mapOutput, bool pipeline)
+{
+    bool ret;
+    int mapped = -1;
+
+    if (mapOutput && pEntry->compression != STORED &&
+            pEntry->uncompLen >= MAPPED_EXTRACT_MIN_SIZE) {
+        mapped = inflateEntryIntoFile(pArchive, pEntry, fd);
+    }
+    if (mapped < 0) {
+        /* The size is known up front, so reserve the blocks before
+         * the first write rather than growing the file a piece at a
+         * time.
+         */
+        if (pEntry->uncompLen >= PREALLOCATE_MIN_SIZE)
+            sysPreallocateFile(fd, pEntry->uncompLen);
+        if (pEntry->compression == STORED) {
+            ret = copyStoredEntryToFile(pArchive, pEntry, fd);
+        } else {
+            ret = writeCompressedEntryToFile(pArchive, pEntry, fd, pipeline);
+        }
+    } else {
+        ret = mapped != 0;
+    }
+    if (!ret) {
+        LOGE("Can't extract entry to file.\n");
+        return false;
+    }
+    return true;
+}
+
+bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    return extractEntryToFile(pArchive, pEntry, fd, false, true);
+}
+
+bool mzExtractZipEntryToMappedFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    return extractEntryToFile(pArchive, pEntry, fd, true, true);
+}
+
+/*
+ * Uncompress "pEntry" in "pArchive" to buffer, which must be large
+ * enough to hold mzGetZipEntryUncomplen(pEntry) bytes, checking its CRC.
+ */
+bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer)
+{
+    if (!extractEntryToExactBuffer(pArchive, pEntry, buffer)) {
+        LOGE("Can't extract entry to memory buffer.\n");
+        return false;
+    }
+    return true;
+}
+
+
+#ifdef MINZIP_BENCHMARK
+/*
+ * Kinds of entry mzDumpInflateStats() reports on separately.
+ */
+static const char* const kInflateStatsKinds[] = {
+    ".apk", ".so", ".odex", ".jar", NULL    // NULL: everything else
+};
+#define NUM_INFLATE_STATS_KINDS \
+        (sizeof(kInflateStatsKinds) / sizeof(kInflateStatsKinds[0]))
+
+static unsigned int inflateStatsKind(const char* name, unsigned int nameLen)
+{
+    unsigned int i;
+
+    for (i = 0; kInflateStatsKinds[i] != NULL; i++) {
+        size_t extLen = strlen(kInflateStatsKinds[i]);
+        if (nameLen >= extLen &&
+            memcmp(name + nameLen - extLen, kInflateStatsKinds[i], extLen) == 0)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Inflate every mapped DEFLATED entry twice, once streamed in 32 KB
+ * pieces and once with the whole-buffer backend, and log the throughput
+ * of each by kind of file.  This is a debugging aid.
+ */
+void mzDumpInflateStats(const ZipArchive* pArchive)
+{
+    unsigned int numEntries[NUM_INFLATE_STATS_KINDS];
+    long long bytes[NUM_INFLATE_STATS_KINDS];
+    long long streamNs[NUM_INFLATE_STATS_KINDS];
+    long long wholeNs[NUM_INFLATE_STATS_KINDS];
+    unsigned int i, kind;
+
+    memset(numEntries, 0, sizeof(numEntries));
+    memset(bytes, 0, sizeof(bytes));
+    memset(streamNs, 0, sizeof(streamNs));
+    memset(wholeNs, 0, sizeof(wholeNs));
+
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        const unsigned char* mapped = getMappedEntryData(pArchive, pEntry);
+        BufferExtractCookie bec;
+        struct timespec start;
+        unsigned char* buffer;
+        bool ok;
+
+        if (mapped == NULL || pEntry->compression != DEFLATED ||
+                pEntry->uncompLen == 0 || pEntry->uncompLen > SIZE_MAX)
+            continue;
+        buffer = (unsigned char*) malloc(pEntry->uncompLen);
+        if (buffer == NULL) {
+            LOGW("Skipping %.*s: can't allocate %lld bytes\n",
+                pEntry->fileNameLen, entryName(pArchive, pEntry),
+                pEntry->uncompLen);
+            continue;
+        }
+        kind = inflateStatsKind(entryName(pArchive, pEntry),
+                pEntry->fileNameLen);
+
+        bec.buffer = buffer;
+        bec.len = pEntry->uncompLen;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ok = mzProcessZipEntryContents(pArchive, pEntry,
+                bufferProcessFunction, (void*)&bec);
+        streamNs[kind] += elapsedNanos(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ok = gInflateBackend.inflateWhole(mapped, pEntry->compLen,
+                buffer, pEntry->uncompLen) && ok;
+        wholeNs[kind] += elapsedNanos(&start);
+
+        if (!ok) {
+            LOGW("Inflating %.*s failed\n",
+                pEntry->fileNameLen, entryName(pArchive, pEntry));
+        }
+        numEntries[kind]++;
+        bytes[kind] += pEntry->uncompLen;
+        free(buffer);
+    }
+
+    for (kind = 0; kind < NUM_INFLATE_STATS_KINDS; kind++) {
+        if (numEntries[kind] == 0)
+            continue;
+        LOGI("Inflate %-6s %6u entries %9lld KB: stream %5lld MB/s, "
+            "%s %5lld MB/s\n",
+            kInflateStatsKinds[kind] != NULL ? kInflateStatsKinds[kind] :
+                    "other",
+            numEntries[kind], bytes[kind] / 1024,
+            streamNs[kind] ? bytes[kind] * 1000 / streamNs[kind] : 0,
+            gInflateBackend.name,
+            wholeNs[kind] ? bytes[kind] * 1000 / wholeNs[kind] : 0);
+    }
+}
+#endif /* MINZIP_BENCHMARK */
+
+/* Helper state to make path translation easier and less malloc-happy.
+ */
+typedef struct {
+    const char *targetDir;
+    const char *zipDir;
+    char *buf;
+    int targetDirLen;
+    int zipDirLen;
+    int bufLen;
+} MzPathHelper;
+
+/* Given the values of targetDir and zipDir in the helper,
+ * return the target filename of the provided entry.
+ * The helper must be initialized first.
+ */
+static const char *targetEntryPath(MzPathHelper *helper,
+    const ZipArchive *pArchive, ZipEntry *pEntry)
+{
+    int needLen;
+    bool firstTime = (helper->buf == NULL);
+
+    /* target file <-- targetDir + / + entry[zipDirLen:]
+     */
+    needLen = helper->targetDirLen + 1 +
+            pEntry->fileNameLen - helper->zipDirLen + 1;
+    if (needLen > helper->bufLen) {
+        char *newBuf;
+
+        needLen *= 2;
+        newBuf = (char *)realloc(helper->buf, needLen);
+        if (newBuf == NULL) {
+            return NULL;
+        }
+        helper->buf = newBuf;
+        helper->bufLen = needLen;
+    }
+
+    /* Every path will start with the target path and a slash.
+     */
+    if (firstTime) {
+        char *p = helper->buf;
+        memcpy(p, helper->targetDir, helper->targetDirLen);
+        p += helper->targetDirLen;
+        if (p == helper->buf || p[-1] != '/') {
+            helper->targetDirLen += 1;
+            *p++ = '/';
+        }
+    }
+
+    /* Replace the custom part of the path with the appropriate
+     * part of the entry's path.
+     */
+    char *epath = helper->buf + helper->targetDirLen;
+    memcpy(epath, entryName(pArchive, pEntry) + helper->zipDirLen,
+            pEntry->fileNameLen - helper->zipDirLen);
+    epath += pEntry->fileNameLen - helper->zipDirLen;
+    *epath = '\0';
+
+    return helper->buf;
+}
+
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/*
+ * A directory known to exist under the target of an mzExtractRecursive()
+ * call, with its path relative to the target ("" for the target itself)
+ * and an fd for it, or -1 if too many were open already.
+ */
+typedef struct {
+    char*           path;
+    unsigned int    pathLen;
+    int             fd;
+} ExtractDir;
+
+/*
+ * The directories an mzExtractRecursive() call has made or found, so
+ * each is checked (and made) once rather than for every file in it, and
+ * files are created relative to its fd rather than by full path.  Only
+ * the extracting thread adds to it; workers just use what's there.
+ */
+typedef struct {
+    HashTable*              table;
+    const char*             targetDir;
+    const struct utimbuf*   timestamp;
+    unsigned int            numFds;
+} ExtractDirCache;
+
+/* keep well clear of the 1024 fds a process gets by default */
+#define MAX_EXTRACT_DIR_FDS 256
+
+/*
+ * (This is a mzHashTableLookup callback.)
+ */
+static int hashcmpExtractDir(const void* vdir1, const void* vdir2)
+{
+    const ExtractDir* dir1 = (const ExtractDir*) vdir1;
+    const ExtractDir* dir2 = (const ExtractDir*) vdir2;
+
+    if (dir1->pathLen != dir2->pathLen)
+        return dir1->pathLen - dir2->pathLen;
+    return memcmp(dir1->path, dir2->path, dir1->pathLen);
+}
+
+/*
+ * (This is a mzHashTableCreate free function.)
+ */
+static void freeExtractDir(void* vdir)
+{
+    ExtractDir* dir = (ExtractDir*) vdir;
+
+    if (dir->fd >= 0)
+        close(dir->fd);
+    free(dir->path);
+    free(dir);
+}
+
+/*
+ * Write the full path of "name" in "dir" to "buf".
+ */
+static bool extractDirFullPath(const ExtractDirCache* cache,
+    const ExtractDir* dir, const char* name, char* buf, size_t bufLen)
+{
+    int n = snprintf(buf, bufLen, "%s/%s%s%s", cache->targetDir, dir->path,
+            dir->pathLen > 0 ? "/" : "", name);
+    if (n < 0 || (size_t) n >= bufLen) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Set *pDirFd and *pName so "name" in "dir" can be passed to the *at()
+ * calls: the directory's fd and "name", or if it has no fd, AT_FDCWD
+ * and the full path, built in "buf".
+ */
+static bool resolveInExtractDir(const ExtractDirCache* cache,
+    const ExtractDir* dir, const char* name, char* buf, size_t bufLen,
+    int* pDirFd, const char** pName)
+{
+    if (dir->fd >= 0) {
+        *pDirFd = dir->fd;
+        *pName = name;
+        return true;
+    }
+    if (!extractDirFullPath(cache, dir, name, buf, bufLen))
+        return false;
+    *pDirFd = AT_FDCWD;
+    *pName = buf;
+    return true;
+}
+
+/*
+ * Set the access and modification times of "name" in "dirFd" (or of
+ * "dirFd" itself if "name" is NULL) to "timestamp".  Fails with ENOSYS
+ * if the kernel can't; callers then use utime() on the full path.
+ */
+static int setTimesAt(int dirFd, const char* name,
+    const struct utimbuf* timestamp)
+{
+#ifdef __NR_utimensat
+    struct timespec times[2];
+
+    times[0].tv_sec = timestamp->actime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = timestamp->modtime;
+    times[1].tv_nsec = 0;
+    return syscall(__NR_utimensat, dirFd, name, times, 0);
+#else
+    (void) dirFd;
+    (void) name;
+    (void) timestamp;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * Add the directory "path" (the first "pathLen" bytes of it; the last
+ * component starts at "nameStart") to the cache, making it in "parent"
+ * if it isn't there.  Something that's already there must be a
+ * directory or a symlink to one.
+ */
+static ExtractDir* addExtractDir(ExtractDirCache* cache,
+    const ExtractDir* parent, const char* path, unsigned int pathLen,
+    unsigned int nameStart)
+{
+    char buf[PATH_MAX];
+    const char* name;
+    ExtractDir* dir;
+    int dirFd;
+
+    dir = (ExtractDir*) calloc(1, sizeof(*dir));
+    if (dir == NULL)
+        return NULL;
+    dir->fd = -1;
+    dir->path = (char*) malloc(pathLen + 1);
+    if (dir->path == NULL)
+        goto fail;
+    memcpy(dir->path, path, pathLen);
+    dir->path[pathLen] = '\0';
+    dir->pathLen = pathLen;
+
+    if (!resolveInExtractDir(cache, parent, dir->path + nameStart, buf,
+            sizeof(buf), &dirFd, &name)) {
+        goto fail;
+    }
+    if (mkdirat(dirFd, name, UNZIP_DIRMODE) == 0) {
+        if (cache->timestamp != NULL &&
+                setTimesAt(dirFd, name, cache->timestamp) != 0 &&
+                (!extractDirFullPath(cache, parent, dir->path + nameStart,
+                        buf, sizeof(buf)) ||
+                 utime(buf, cache->timestamp) != 0)) {
+            goto fail;
+        }
+    } else if (errno != EEXIST) {
+        goto fail;
+    }
+
+    /* Opening it also checks that it's a directory.
+     */
+    dir->fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY);
+    if (dir->fd < 0)
+        goto fail;
+    if (cache->numFds < MAX_EXTRACT_DIR_FDS) {
+        cache->numFds++;
+    } else {
+        close(dir->fd);
+        dir->fd = -1;
+    }
+
+    mzHashTableLookup(cache->table, computeHash(dir->path, pathLen), dir,
+            hashcmpExtractDir, true);
+    return dir;
+
+fail:
+    {
+        int save = errno;
+        freeExtractDir(dir);
+        errno = save;
+    }
+    return NULL;
+}
+
+/*
+ * Make sure the directory at the first "pathLen" bytes of "path"
+ * (relative to the target) exists, making it and any missing parents,
+ * and return its cache entry, or NULL (with errno set) on failure.
+ */
+static const ExtractDir* getExtractDir(ExtractDirCache* cache,
+    const char* path, unsigned int pathLen)
+{
+    ExtractDir key;
+    ExtractDir* dir;
+    unsigned int len;
+
+    while (pathLen > 0 && path[pathLen - 1] == '/')
+        pathLen--;
+    len = pathLen;
+
+    /* Find the deepest directory on the way that we know about.
+     */
+    for (;;) {
+        key.path = (char*) path;
+        key.pathLen = len;
+        dir = (ExtractDir*) mzHashTableLookup(cache->table,
+                computeHash(path, len), &key, hashcmpExtractDir, false);
+        if (dir != NULL)
+            break;
+        if (len == 0) {
+            /* The target itself; "mkdir -p" it, as we always have.
+             */
+            if (dirCreateHierarchy(cache->targetDir, UNZIP_DIRMODE,
+                    cache->timestamp, false) != 0)
+                return NULL;
+            dir = (ExtractDir*) calloc(1, sizeof(*dir));
+            if (dir == NULL || (dir->path = strdup("")) == NULL) {
+                free(dir);
+                errno = ENOMEM;
+                return NULL;
+            }
+            dir->fd = open(cache->targetDir, O_RDONLY | O_DIRECTORY);
+            if (dir->fd < 0) {
+                int save = errno;
+                freeExtractDir(dir);
+                errno = save;
+                return NULL;
+            }
+            cache->numFds++;
+            mzHashTableLookup(cache->table, computeHash(path, 0), dir,
+                    hashcmpExtractDir, true);
+            break;
+        }
+        /* up a level */
+        while (len > 0 && path[len - 1] != '/')
+            len--;
+        while (len > 0 && path[len - 1] == '/')
+            len--;
+    }
+
+    /* Then make the rest, a level at a time.
+     */
+    while (len < pathLen) {
+        unsigned int start = len, end;
+
+        while (start < pathLen && path[start] == '/')
+            start++;
+        if (start == pathLen)
+            break;          /* just trailing slashes */
+        end = start;
+        while (end < pathLen && path[end] != '/')
+            end++;
+        dir = addExtractDir(cache, dir, path, end, start);
+        if (dir == NULL)
+            return NULL;
+        len = end;
+    }
+    return dir;
+}
+
+/*
+ * Create the symbolic link described by "pEntry" at "targetFile".  The
+ * relative target of the symlink is in the data section of the entry.
+ */
+static bool extractSymlinkEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const char *targetFile)
+{
+    if (pEntry->uncompLen == 0) {
+        LOGE("Symlink entry \"%s\" has no target\n",
+                targetFile);
+        return false;
+    }
+    if (pEntry->uncompLen >= PATH_MAX) {
+        LOGE("Symlink entry \"%s\" has an oversized target (%lld bytes)\n",
+                targetFile, pEntry->uncompLen);
+        return false;
+    }
+    char *linkTarget = malloc(pEntry->uncompLen + 1);
+    if (linkTarget == NULL) {
+        return false;
+    }
+    if (!mzReadZipEntry(pArchive, pEntry, linkTarget, pEntry->uncompLen)) {
+        LOGE("Can't read symlink target for \"%s\"\n",
+                targetFile);
+        free(linkTarget);
+        return false;
+    }
+    linkTarget[pEntry->uncompLen] = '\0';
+
+    /* Make the link.
+     */
+    if (symlink(linkTarget, targetFile) != 0) {
+        LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                targetFile, linkTarget, strerror(errno));
+        free(linkTarget);
+        return false;
+    }
+    LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+            targetFile, linkTarget);
+    free(linkTarget);
     return true;
 }
 
 /*
- * Check the CRC on this entry; return true if it is correct.
- * May do other internal checks as well.
+ * Write the regular file described by "pEntry" to "targetFile", which is
+ * "name" in the directory "dir".  Safe to call from several threads at
+ * once; "pipeline" should be false then, so a big entry doesn't start
+ * an inflate thread of its own on top of them.
  */
-bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
+static bool extractFileEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const ExtractDirCache *dirs,
+    const ExtractDir *dir, const char *name, const char *targetFile,
+    bool pipeline)
 {
-    unsigned long crc;
-    bool ret;
+    const struct utimbuf *timestamp = dirs->timestamp;
+    char buf[PATH_MAX];
+    int dirFd;
 
-    crc = crc32(0L, Z_NULL, 0);
-    ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
-            (void *)&crc);
-    if (!ret) {
-        LOGE("Can't calculate CRC for entry\n");
+    /* Open the target for writing.
+     */
+    int fd = -1;
+    if (resolveInExtractDir(dirs, dir, name, buf, sizeof(buf), &dirFd,
+            &name)) {
+        fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_TRUNC,
+                UNZIP_FILEMODE);
+    }
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
         return false;
     }
-    if (crc != (unsigned long)pEntry->crc32) {
-        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
-                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+
+    bool ok = extractEntryToFile(pArchive, pEntry, fd, false, pipeline);
+    if (ok && timestamp != NULL && setTimesAt(fd, NULL, timestamp) != 0) {
+        close(fd);
+        if (utime(targetFile, timestamp)) {
+            LOGE("Error touching \"%s\"\n", targetFile);
+            return false;
+        }
+        fd = -1;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
         return false;
     }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
     return true;
 }
 
+/*
+ * A regular file queued for extraction.
+ */
 typedef struct {
-    char *buf;
-    int bufLen;
-} CopyProcessArgs;
+    const ZipEntry*     pEntry;
+    char*               targetFile;
+    const ExtractDir*   dir;            // that the file goes in
+    unsigned int        nameOffset;     // of its name in targetFile
+} ExtractJob;
 
-static bool copyProcessFunction(const unsigned char *data, int dataLen,
-        void *cookie)
+/*
+ * State shared by the extraction workers.  Workers pull the next job
+ * under "lock"; everything else is read-only while the pool runs.
+ */
+typedef struct {
+    const ZipArchive*       pArchive;
+    const ExtractDirCache*  dirs;
+    ExtractJob*             jobs;
+    unsigned int            numJobs;
+    unsigned int            nextJob;
+    bool                    failed;
+    bool                    pipeline;       // only with a single worker
+    pthread_mutex_t         lock;
+} ExtractPool;
+
+#define MAX_EXTRACT_THREADS 8
+
+static void* extractWorker(void* arg)
 {
-    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
-    if (dataLen <= args->bufLen) {
-        memcpy(args->buf, data, dataLen);
-        args->buf += dataLen;
-        args->bufLen -= dataLen;
-        return true;
+    ExtractPool* pool = (ExtractPool*) arg;
+
+    while (true) {
+        const ExtractJob* job = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->failed && pool->nextJob < pool->numJobs) {
+            job = &pool->jobs[pool->nextJob++];
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (job == NULL) {
+            break;
+        }
+        if (!extractFileEntry(pool->pArchive, job->pEntry, pool->dirs,
+                job->dir, job->targetFile + job->nameOffset,
+                job->targetFile, pool->pipeline))
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = true;
+            pthread_mutex_unlock(&pool->lock);
+        }
     }
-    return false;
+    return NULL;
 }
 
 /*
- * Read an entry into a buffer allocated by the caller.
+ * Extract all queued files, in queue order, using one worker per online
+ * CPU (the calling thread included), up to "maxThreads".  Stops handing
+ * out new jobs after the first failure.
  */
-bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
-        char *buf, int bufLen)
+static bool runExtractPool(ExtractPool* pool, long maxThreads)
 {
-    CopyProcessArgs args;
-    bool ret;
+    pthread_t threads[MAX_EXTRACT_THREADS];
+    long numThreads;
+    int i, started;
 
-    args.buf = buf;
-    args.bufLen = bufLen;
-    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
-            (void *)&args);
-    if (!ret) {
-        LOGE("Can't extract entry to buffer.\n");
-        return false;
+    if (maxThreads > MAX_EXTRACT_THREADS) {
+        maxThreads = MAX_EXTRACT_THREADS;
+    }
+    numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > maxThreads) {
+        numThreads = maxThreads;
+    }
+    if ((unsigned long) numThreads > pool->numJobs) {
+        numThreads = pool->numJobs > 0 ? pool->numJobs : 1;
     }
-    return true;
-}
 
-static bool writeProcessFunction(const unsigned char *data, int dataLen,
-                                 void *cookie)
-{
-    int fd = (int)cookie;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->pipeline = numThreads == 1;
 
-    ssize_t soFar = 0;
-    while (true) {
-        ssize_t n = write(fd, data+soFar, dataLen-soFar);
-        if (n <= 0) {
-            LOGE("Error writing %ld bytes from zip file from %p: %s\n",
-                 dataLen-soFar, data+soFar, strerror(errno));
-            if (errno != EINTR) {
-              return false;
-            }
-        } else if (n > 0) {
-            soFar += n;
-            if (soFar == dataLen) return true;
-            if (soFar > dataLen) {
-                LOGE("write overrun?  (%ld bytes instead of %d)\n",
-                     soFar, dataLen);
-                return false;
-            }
+    /* The calling thread is worker 0.  If we can't start a thread, just
+     * carry on with the ones we have.
+     */
+    started = 0;
+    for (i = 1; i < numThreads; i++) {
+        if (pthread_create(&threads[started], NULL, extractWorker, pool) != 0) {
+            LOGW("Can't start extraction thread: %s\n", strerror(errno));
+            break;
         }
+        started++;
     }
+    extractWorker(pool);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    LOGV("Extracted %u files with %d threads\n", pool->numJobs, started + 1);
+    return !pool->failed;
 }
 
 /*
- * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ * (This is a qsort() callback.)
+ *
+ * Order jobs by where their data is in the archive.
  */
-bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, int fd)
+static int compareJobOffsets(const void* vjob1, const void* vjob2)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)fd);
-    if (!ret) {
-        LOGE("Can't extract entry to file.\n");
-        return false;
-    }
-    return true;
-}
+    const ExtractJob* job1 = (const ExtractJob*) vjob1;
+    const ExtractJob* job2 = (const ExtractJob*) vjob2;
 
-typedef struct {
-    unsigned char* buffer;
-    long len;
-} BufferExtractCookie;
+    if (job1->pEntry->offset != job2->pEntry->offset)
+        return job1->pEntry->offset < job2->pEntry->offset ? -1 : 1;
+    return 0;
+}
 
-static bool bufferProcessFunction(const unsigned char *data, int dataLen,
-    void *cookie) {
-    BufferExtractCookie *bec = (BufferExtractCookie*)cookie;
+/*
+ * Tell the kernel how we're about to read the span of the archive that
+ * holds the queued files ("sequential" true), or that we're done with
+ * it.  Covers both the mapping and pread() on the fd.
+ */
+static void adviseJobSpan(const ExtractPool* pool, bool sequential)
+{
+    long long start = LLONG_MAX, end = 0;
+    unsigned int i;
 
-    memmove(bec->buffer, data, dataLen);
-    bec->buffer += dataLen;
-    bec->len -= dataLen;
+    for (i = 0; i < pool->numJobs; i++) {
+        const ZipEntry* pEntry = pool->jobs[i].pEntry;
+        if (pEntry->offset < start)
+            start = pEntry->offset;
+        if (pEntry->offset + pEntry->compLen > end)
+            end = pEntry->offset + pEntry->compLen;
+    }
+    if (start >= end)
+        return;
 
-    return true;
+    if (pool->pArchive->map.addr != NULL && (unsigned long long) end <=
+            pool->pArchive->map.length) {
+        sysAdviseMapRange(&pool->pArchive->map, start, end - start,
+                sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+    }
+    adviseArchiveRange(pool->pArchive, start, end - start,
+            sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
 }
 
 /*
- * Uncompress "pEntry" in "pArchive" to buffer, which must be large
- * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
+ * Count the places where reading the queued files in order has to jump
+ * backwards in the archive.
  */
-bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, unsigned char *buffer)
+static unsigned int countBackwardSeeks(const ExtractPool* pool)
 {
-    BufferExtractCookie bec;
-    bec.buffer = buffer;
-    bec.len = mzGetZipEntryUncompLen(pEntry);
+    unsigned int i, seeks = 0;
 
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry,
-        bufferProcessFunction, (void*)&bec);
-    if (!ret || bec.len != 0) {
-        LOGE("Can't extract entry to memory buffer.\n");
-        return false;
+    for (i = 1; i < pool->numJobs; i++) {
+        if (pool->jobs[i].pEntry->offset < pool->jobs[i - 1].pEntry->offset)
+            seeks++;
     }
-    return true;
+    return seeks;
 }
 
+static long long elapsedMillis(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000LL +
+        (now.tv_nsec - start->tv_nsec) / 1000000;
+}
 
-/* Helper state to make path translation easier and less malloc-happy.
+/*
+ * Log how fast mzExtractRecursive() went.  Verbose only; this is for
+ * comparing the serial and parallel paths, not for every install.
  */
-typedef struct {
-    const char *targetDir;
-    const char *zipDir;
-    char *buf;
-    int targetDirLen;
-    int zipDirLen;
-    int bufLen;
-} MzPathHelper;
+static void logExtractStats(unsigned int numFiles, long long numBytes,
+    long long numCompBytes, long long ms, long long readMs,
+    unsigned int backwardSeeks, bool parallel, bool nameOrder)
+{
+    LOGV("Extracted %u files (%lld bytes) in %lld ms%s"
+            ": %lld files/s, %lld KB/s\n",
+            numFiles, numBytes, ms,
+            parallel ? " in parallel" : "",
+            numFiles * 1000LL / (ms > 0 ? ms : 1),
+            numBytes * 1000LL / 1024 / (ms > 0 ? ms : 1));
+    LOGV("Read %lld KB of package data in %lld ms (%lld KB/s) in %s"
+            " order, %u backward seeks\n",
+            numCompBytes / 1024, readMs,
+            numCompBytes * 1000LL / 1024 / (readMs > 0 ? readMs : 1),
+            nameOrder ? "name" : "archive", backwardSeeks);
+}
 
-/* Given the values of targetDir and zipDir in the helper,
- * return the target filename of the provided entry.
- * The helper must be initialized first.
+#if SORT_ENTRIES
+/*
+ * Return the index of the first entry whose name doesn't sort before
+ * "prefix" (i.e. the lower bound in compareZipEntries() order), or
+ * numEntries if there isn't one.  Every entry whose name starts with
+ * "prefix" is in the contiguous run that begins there.
  */
-static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
+static unsigned int findFirstEntryNotBefore(const ZipArchive *pArchive,
+    const char *prefix, unsigned int prefixLen)
 {
-    int needLen;
-    bool firstTime = (helper->buf == NULL);
-
-    /* target file <-- targetDir + / + entry[zipDirLen:]
-     */
-    needLen = helper->targetDirLen + 1 +
-            pEntry->fileNameLen - helper->zipDirLen + 1;
-    if (needLen > helper->bufLen) {
-        char *newBuf;
-
-        needLen *= 2;
-        newBuf = (char *)realloc(helper->buf, needLen);
-        if (newBuf == NULL) {
-            return NULL;
-        }
-        helper->buf = newBuf;
-        helper->bufLen = needLen;
-    }
-
-    /* Every path will start with the target path and a slash.
-     */
-    if (firstTime) {
-        char *p = helper->buf;
-        memcpy(p, helper->targetDir, helper->targetDirLen);
-        p += helper->targetDirLen;
-        if (p == helper->buf || p[-1] != '/') {
-            helper->targetDirLen += 1;
-            *p++ = '/';
+    unsigned int low = 0;
+    unsigned int high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;     // avoid overflow
+        const ZipEntry* pEntry = &pArchive->pEntries[mid];
+        unsigned int minLen;
+        int diff;
+
+        minLen = pEntry->fileNameLen < prefixLen ?
+                pEntry->fileNameLen : prefixLen;
+        diff = memcmp(entryName(pArchive, pEntry), prefix, minLen);
+        if (diff == 0 && pEntry->fileNameLen < prefixLen)
+            diff = -1;
+        if (diff < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
-
-    /* Replace the custom part of the path with the appropriate
-     * part of the entry's path.
-     */
-    char *epath = helper->buf + helper->targetDirLen;
-    memcpy(epath, pEntry->fileName + helper->zipDirLen,
-            pEntry->fileNameLen - helper->zipDirLen);
-    epath += pEntry->fileNameLen - helper->zipDirLen;
-    *epath = '\0';
-
-    return helper->buf;
+    return low;
 }
+#endif
 
 /*
  * Inflate all entries under zipDir to the directory specified by
@@ -925,6 +3982,12 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *     /tmp/two
  *     /tmp/d/three
  *
+ * Directories and symlinks are created in name order as we go, so parents
+ * always come first.  Regular files are queued and written once every
+ * directory exists, in the order their data appears in the archive, so
+ * the package is read front to back instead of seeking around it.  With
+ * MZ_EXTRACT_PARALLEL they are written by a worker pool.
+ *
  * Returns true on success, false on failure.
  */
 bool mzExtractRecursive(const ZipArchive *pArchive,
@@ -976,57 +4039,75 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    /* Regular files are queued and written at the end, on a pool of
+     * threads if asked.
+     */
+    bool parallel = (flags & MZ_EXTRACT_PARALLEL) &&
+            !(flags & MZ_EXTRACT_DRY_RUN);
+    ExtractPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+
+    /* Directories are made once each, and kept open for the files.
+     */
+    ExtractDirCache dirs;
+    dirs.targetDir = targetDir;
+    dirs.timestamp = timestamp;
+    dirs.numFds = 0;
+    dirs.table = mzHashTableCreate(64, freeExtractDir);
+    if (dirs.table == NULL) {
+        free(zpath);
+        return false;
+    }
+    pool.dirs = &dirs;
+
+    struct timespec start;
+    unsigned int numFiles = 0;
+    long long numBytes = 0, numCompBytes = 0, readMs = 0;
+    unsigned int backwardSeeks = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+     * with zpath.  Since the entries are sorted, those form one
+     * contiguous run starting at the first entry that doesn't sort
+     * before zpath, so binary search for it and stop at the first
+     * non-match.
      */
     unsigned int i;
-    bool seenMatch = false;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
+#if SORT_ENTRIES
+    i = findFirstEntryNotBefore(pArchive, zpath, zipDirLen);
+#else
+    i = 0;
+#endif
+    for (; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+        const char *fileName = entryName(pArchive, pEntry);
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
+        /* If zpath is empty, this memcmp() will match everything,
          * which is what we want.
          */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
+        if (pEntry->fileNameLen < zipDirLen ||
+            memcmp(fileName, zpath, zipDirLen) != 0)
+        {
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+            break;
+#else
             continue;
+#endif
         }
         /* This entry begins with zipDir, so we'll extract it.
          */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
-        const char *targetFile = targetEntryPath(&helper, pEntry);
+        const char *targetFile = targetEntryPath(&helper, pArchive, pEntry);
         if (targetFile == NULL) {
             LOGE("Can't assemble target path for \"%.*s\"\n",
-                    pEntry->fileNameLen, pEntry->fileName);
+                    pEntry->fileNameLen, fileName);
             ok = false;
             break;
         }
@@ -1040,13 +4121,10 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
-        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+        const char *relPath = targetFile + helper.targetDirLen;
+        if (fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
-                        targetFile, UNZIP_DIRMODE, timestamp, false);
-                if (ret != 0) {
+                if (getExtractDir(&dirs, relPath, strlen(relPath)) == NULL) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
                             targetFile, strerror(errno));
                     ok = false;
@@ -1058,9 +4136,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true);
-            if (ret != 0) {
+            const char *name = strrchr(relPath, '/');
+            name = (name != NULL) ? name + 1 : relPath;
+            const ExtractDir *dir = getExtractDir(&dirs, relPath,
+                    name - relPath);
+            if (dir == NULL) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
                         targetFile, strerror(errno));
                 ok = false;
@@ -1070,80 +4150,135 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* With FILES_ONLY set, we need to ignore metadata entirely,
              * so treat symlinks as regular files.
              */
-            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
-                 */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
+            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pArchive, pEntry)) {
+                ok = extractSymlinkEntry(pArchive, pEntry, targetFile);
                 if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
                     break;
                 }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
             } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
+                /* Queue the file; it's written (and the callback
+                 * invoked) once all directories exist.
                  */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
+                if (pool.numJobs % 256 == 0) {
+                    ExtractJob* newJobs = (ExtractJob*) realloc(pool.jobs,
+                            (pool.numJobs + 256) * sizeof(ExtractJob));
+                    if (newJobs == NULL) {
+                        LOGE("Can't queue \"%s\"\n", targetFile);
+                        ok = false;
+                        break;
+                    }
+                    pool.jobs = newJobs;
                 }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                pool.jobs[pool.numJobs].pEntry = pEntry;
+                pool.jobs[pool.numJobs].dir = dir;
+                pool.jobs[pool.numJobs].nameOffset = name - targetFile;
+                pool.jobs[pool.numJobs].targetFile = strdup(targetFile);
+                if (pool.jobs[pool.numJobs].targetFile == NULL) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
+                pool.numJobs++;
+                continue;
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && pool.numJobs > 0) {
+        struct timespec readStart;
+
+        if (!(flags & MZ_EXTRACT_NAME_ORDER)) {
+            qsort(pool.jobs, pool.numJobs, sizeof(ExtractJob),
+                    compareJobOffsets);
+        }
+        backwardSeeks = countBackwardSeeks(&pool);
+
+        clock_gettime(CLOCK_MONOTONIC, &readStart);
+        adviseJobSpan(&pool, true);
+        ok = runExtractPool(&pool, parallel ? MAX_EXTRACT_THREADS : 1);
+        adviseJobSpan(&pool, false);
+        readMs = elapsedMillis(&readStart);
+    }
+    for (i = 0; i < pool.numJobs; i++) {
+        if (ok) {
+            numFiles++;
+            numBytes += pool.jobs[i].pEntry->uncompLen;
+            numCompBytes += pool.jobs[i].pEntry->compLen;
+            if (callback != NULL) callback(pool.jobs[i].targetFile, cookie);
+        }
+        free(pool.jobs[i].targetFile);
+    }
+    free(pool.jobs);
+    LOGV("Used %d directories (%u open)\n", mzHashTableNumEntries(dirs.table),
+            dirs.numFds);
+    mzHashTableFree(dirs.table);
+
+    if (ok && numFiles > 0) {
+        logExtractStats(numFiles, numBytes, numCompBytes,
+                elapsedMillis(&start), readMs, backwardSeeks, parallel,
+                (flags & MZ_EXTRACT_NAME_ORDER) != 0);
+    }
+
     free(helper.buf);
     free(zpath);
 
     return ok;
 }
+
+#ifdef MINZIP_BENCHMARK
+typedef struct {
+    unsigned int numFiles;
+    long long numBytes;
+} ExtractStatsCookie;
+
+static void countExtractedFile(const char* fn, void* cookie)
+{
+    ExtractStatsCookie* c = (ExtractStatsCookie*) cookie;
+    struct stat st;
+
+    if (lstat(fn, &st) == 0 && S_ISREG(st.st_mode)) {
+        c->numFiles++;
+        c->numBytes += st.st_size;
+    }
+}
+
+/*
+ * Extract everything under zipDir to targetDir serially and then with
+ * MZ_EXTRACT_PARALLEL, and log files/s and MB/s for each.  An untimed
+ * serial run goes first, so both timed runs find the package in the
+ * page cache and the files already there to overwrite.  This is a
+ * debugging aid.
+ */
+bool mzDumpExtractStats(const ZipArchive* pArchive, const char* zipDir,
+    const char* targetDir)
+{
+    static const int kFlags[] = { 0, 0, MZ_EXTRACT_PARALLEL };
+    unsigned int run;
+
+    for (run = 0; run < sizeof(kFlags) / sizeof(kFlags[0]); run++) {
+        ExtractStatsCookie c;
+        struct timespec start;
+        long long ns;
+
+        memset(&c, 0, sizeof(c));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!mzExtractRecursive(pArchive, zipDir, targetDir, kFlags[run],
+                NULL, countExtractedFile, &c)) {
+            LOGW("Extracting \"%s\" to %s failed\n", zipDir, targetDir);
+            return false;
+        }
+        ns = elapsedNanos(&start);
+        if (run == 0)
+            continue;
+        if (ns <= 0)
+            ns = 1;
+        LOGI("Extract %-8s %6u files %9lld KB in %6lld ms: "
+            "%7lld files/s, %5lld MB/s\n",
+            kFlags[run] & MZ_EXTRACT_PARALLEL ? "parallel" : "serial",
+            c.numFiles, c.numBytes / 1024, ns / 1000000,
+            c.numFiles * 1000000000LL / ns, c.numBytes * 1000 / ns);
+    }
+    return true;
+}
+#endif /* MINZIP_BENCHMARK */
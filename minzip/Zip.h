@@ -8,41 +8,57 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 /*
  * One entry in the Zip archive.  Treat this as opaque -- use accessors below.
  *
- * TODO: we're now keeping the pages mapped so we don't have to copy the
- * filename.  We can change the accessors to retrieve the various pieces
- * directly from the source file instead of copying them out, for a very
- * slight speed hit and a modest reduction in memory usage.
+ * Only what lookups and the data path need is kept here.  The central
+ * directory stays in memory, so the name and the rarely used fields (mod
+ * time, "version made by", external attributes) are decoded from it on
+ * demand by the accessors, which is why they take the archive too.
  */
 typedef struct ZipEntry {
-    unsigned int fileNameLen;
-    const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
-    int          compression;
-    long         modTime;
-    long         crc32;
-    int          versionMadeBy;
-    long         externalFileAttributes;
+    unsigned int   cdOffset;     // of the CD record, from ZipArchive.centralDir
+    unsigned int   nameHash;
+    unsigned short fileNameLen;
+    unsigned short compression;
+    unsigned int   crc32;
+    long long      offset;       // of the data, or with headerOffsets the
+                                 // local header; 64-bit for Zip64 archives
+    long long      compLen;
+    long long      uncompLen;
 } ZipEntry;
 
 /*
  * One Zip archive.  Treat as opaque.
+ *
+ * Concurrency: once mzOpenZipArchive() has returned, the archive is
+ * never modified until mzCloseZipArchive().  Entry data is only ever read
+ * from the mapping or with pread(), so the shared fd's offset is never
+ * used.  That makes mzFindZipEntry(), mzProcessZipEntryContents(),
+ * mzReadZipEntry(), mzIsZipEntryIntact(), the mzExtract* functions and
+ * the ZipEntryReader functions safe to call from any number of threads
+ * on the same archive at the same time, for the same or different
+ * entries.  Opening and closing the archive must not race with any of
+ * them.
  */
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
     ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    struct ZipNameSlot* pNameIndex;     // maps file name to ZipEntry
+    unsigned int nameIndexMask;         // index size - 1
+    const unsigned char* centralDir;    // start of the CD
+    unsigned char* dirBuf;              // CD read in, if the file isn't mapped
+    bool        headerOffsets;          // entry offsets are of local headers
+    struct ZipPart* parts;              // files of a split archive, in order
+    unsigned int numParts;              // (fd is -1); 0 for a single file
+    bool        spanned;                // split with per-part offsets (.z01)
     MemMapping  map;
 } ZipArchive;
 
@@ -58,11 +74,48 @@ typedef struct {
 /*
  * Open a Zip archive.
  *
+ * Zip64 archives (more than 65535 entries, or entries and offsets beyond
+ * 4GB) are supported; all sizes and offsets are 64-bit.
+ *
+ * The whole file is mapped, so entry data can be used in place.  If it
+ * can't be (a package of several GB on a 32-bit device), this falls back
+ * to mzOpenZipArchiveDirOnly().
+ *
+ * Archives split to fit on FAT32 are opened as a whole, in place: given
+ * "pkg.zip.001" the parts are pkg.zip.001, .002, ... (the archive cut
+ * into pieces), and given "pkg.zip" with a "pkg.z01" beside it they are
+ * pkg.z01, .z02, ..., pkg.zip (a standard split Zip).  Split archives
+ * are always read as by mzOpenZipArchiveDirOnly().
+ *
  * On success, returns 0 and populates "pArchive".  Returns nonzero errno
  * value on failure.
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive without mapping it.  Only the end of the file and
+ * the central directory are read; entry data is read with pread() when
+ * it's asked for.  Memory use is proportional to the directory, not the
+ * package.
+ *
+ * Returns the same as mzOpenZipArchive().
+ */
+int mzOpenZipArchiveDirOnly(const char* fileName, ZipArchive* pArchive);
+
+/*
+ * Like mzOpenZipArchive(), or mzOpenZipArchiveDirOnly() if "dirOnly", but
+ * reuse the entry table and name index saved at "indexPath" by an earlier
+ * open of the same package instead of parsing the central directory.  The
+ * index is only used if the package's size, mtime and central directory
+ * match, and its entries check out against the central directory;
+ * otherwise the package is parsed and the index rewritten.  The index
+ * file is read into memory and closed before this returns.
+ *
+ * Returns the same as mzOpenZipArchive().
+ */
+int mzOpenZipArchiveIndexed(const char* fileName, const char* indexPath,
+    bool dirOnly, ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -78,6 +131,17 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+#ifdef MINZIP_BENCHMARK
+/*
+ * Log statistics on name lookups: probe lengths and time per lookup for
+ * the archive's name index, and for the same names in a general-purpose
+ * HashTable using the old "31 * hash + c" hash, for comparison.  This is
+ * a debugging aid; it looks up every name several times.  Only built
+ * with MINZIP_BENCHMARK.
+ */
+void mzDumpZipNameIndexStats(const ZipArchive* pArchive);
+#endif
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -107,26 +171,29 @@ mzGetZipEntryIndex(const ZipArchive *pArchive, const ZipEntry *pEntry) {
 
 /*
  * Simple accessors.
+ *
+ * For archives opened with mzOpenZipArchiveDirOnly() (or from an index
+ * made by one), the offset is that of the entry's local header rather
+ * than of its data.
  */
-INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
-    UnterminatedString ret;
-    ret.str = pEntry->fileName;
-    ret.len = pEntry->fileNameLen;
-    return ret;
-}
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
-INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
-    return pEntry->modTime;
-}
 INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
     return pEntry->crc32;
 }
-bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
+
+/*
+ * Accessors for the fields that are read from the central directory
+ * on each call.
+ */
+UnterminatedString mzGetZipEntryFileName(const ZipArchive* pArchive,
+    const ZipEntry* pEntry);
+long mzGetZipEntryModTime(const ZipArchive* pArchive, const ZipEntry* pEntry);
+bool mzIsZipEntrySymlink(const ZipArchive* pArchive, const ZipEntry* pEntry);
 
 
 /*
@@ -150,8 +217,51 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie);
 
+/*
+ * Caller-owned state for pulling an entry's uncompressed data a chunk at
+ * a time.  All per-stream state lives here, so several threads can each
+ * stream a different entry (or the same one) from one archive using
+ * their own reader.  A single reader must not be shared between threads
+ * without external locking.  Treat as opaque.
+ */
+typedef struct ZipEntryReader {
+    const ZipArchive*    pArchive;
+    const ZipEntry*      pEntry;
+    const unsigned char* mapped;         /* next compressed byte, if mapped */
+    long long            compOffset;     /* file offset of next compressed byte */
+    long long            compRemaining;
+    long long            uncompRead;     /* uncompressed bytes produced so far */
+    void*                inflater;       /* decompressor state, if compressed */
+} ZipEntryReader;
+
+/*
+ * Prepare "pReader" to stream the contents of "pEntry".  Returns false
+ * if the entry uses an unsupported compression method or resources
+ * can't be allocated.  On success, mzCloseZipEntryReader() must be
+ * called when done.
+ */
+bool mzOpenZipEntryReader(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    ZipEntryReader *pReader);
+
+/*
+ * Read up to "bufLen" bytes of uncompressed data into "buf".  Returns the
+ * number of bytes read, 0 once the whole entry has been read, or -1 on
+ * error (including a size mismatch with the central directory).
+ */
+long mzReadZipEntryReader(ZipEntryReader *pReader, unsigned char *buf,
+    long bufLen);
+
+/*
+ * Release the resources held by "pReader".
+ */
+void mzCloseZipEntryReader(ZipEntryReader *pReader);
+
 /*
  * Read an entry into a buffer allocated by the caller.
+ *
+ * This, mzExtractZipEntryToFile() and mzExtractZipEntryToBuffer() (and so
+ * mzExtractRecursive()) check the entry's CRC as the data goes by, and
+ * fail if it doesn't match.  The output has been written by then.
  */
 bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
         char* buf, int bufLen);
@@ -159,15 +269,29 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
 /*
  * Check the CRC on this entry; return true if it is correct.
  * May do other internal checks as well.
+ *
+ * There's no need to call this before extracting an entry; the
+ * extraction functions below check the CRC themselves.
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
 /*
- * Inflate and write an entry to a file.
+ * Inflate and write an entry to a file, at its current offset.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
 
+/*
+ * Like mzExtractZipEntryToFile(), but if "fd" is a regular file open for
+ * reading and writing, large compressed entries are inflated straight
+ * into a mapping of it, with the space allocated up front.  That keeps
+ * the file contiguous and saves a copy and a write() per 32 KB, at the
+ * price of a page fault per page.  Falls back to writing if the file
+ * can't be preallocated or mapped.
+ */
+bool mzExtractZipEntryToMappedFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd);
+
 /*
  * Inflate and write an entry to a memory buffer, which must be long
  * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
@@ -175,6 +299,17 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
 
+#ifdef MINZIP_BENCHMARK
+/*
+ * Log inflate throughput, by kind of file (.apk, .so, .odex, ...), for
+ * streaming in 32 KB pieces against inflating each whole entry into a
+ * buffer in one call (as mzExtractZipEntryToBuffer() does for mapped
+ * entries).  This is a debugging aid; it inflates every entry twice.
+ * Only built with MINZIP_BENCHMARK.
+ */
+void mzDumpInflateStats(const ZipArchive* pArchive);
+#endif
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -197,17 +332,43 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - inflate and write regular files on a pool of
+ *         worker threads (one per online CPU).
+ *     MZ_EXTRACT_NAME_ORDER - write regular files in name order rather
+ *         than in the order their data appears in the archive (for
+ *         comparing read patterns; it's slower on cold storage)
+ *
+ * Directories and symlinks are created in name order before any regular
+ * file is written.
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
  * If callback is non-NULL, it will be invoked with each unpacked file.
+ * The callback for regular files is invoked on the calling thread after
+ * all of them have been written.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_PARALLEL = 4,
+    MZ_EXTRACT_NAME_ORDER = 8,
+};
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
         void (*callback)(const char *fn, void*), void *cookie);
 
+#ifdef MINZIP_BENCHMARK
+/*
+ * Extract everything under zipDir to targetDir once serially and once
+ * with MZ_EXTRACT_PARALLEL (after an untimed warm-up run), and log the
+ * files/s and MB/s of each.  Returns false if any run fails.  Only
+ * built with MINZIP_BENCHMARK.
+ */
+bool mzDumpExtractStats(const ZipArchive* pArchive, const char* zipDir,
+        const char* targetDir);
+#endif
+
 #endif /*_MINZIP_ZIP*/
@@ -0,0 +1,295 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Check extraction of each compression method minzip knows about.
+ *
+ * testdata/codecs.zip has the same three files (big.txt, small.txt and
+ * empty.txt) under stored/, deflate/, zstd/ and lz4/, each directory
+ * using that method.  Every copy must come out the same as the stored
+ * one through a ZipEntryReader, mzExtractZipEntryToBuffer(),
+ * mzExtractZipEntryToFile() and mzExtractRecursive() (with and without
+ * MZ_EXTRACT_PARALLEL), and pass
+ * mzIsZipEntryIntact().  Methods this build doesn't support (zstd
+ * without MINZIP_HAVE_ZSTD, LZ4 without MINZIP_HAVE_LZ4) must be
+ * refused instead.
+ *
+ * testdata/badcrc.zip has big.txt once per method with a wrong CRC in
+ * the central directory; extracting any supported one must fail.
+ *
+ * Usage: minzip_codec_test codecs.zip badcrc.zip
+ * Exits nonzero on any failure.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "minzip/Zip.h"
+
+typedef struct {
+    const char* dir;
+    unsigned short compression;
+    bool supported;
+} Codec;
+
+static const Codec kCodecs[] = {
+    { "stored",  0,      true },
+    { "deflate", 8,      true },
+#ifdef MINZIP_HAVE_ZSTD
+    { "zstd",    93,     true },
+#else
+    { "zstd",    93,     false },
+#endif
+#ifdef MINZIP_HAVE_LZ4
+    { "lz4",     0x4c34, true },
+#else
+    { "lz4",     0x4c34, false },
+#endif
+};
+#define NUM_CODECS (sizeof(kCodecs) / sizeof(kCodecs[0]))
+
+static const char* const kFiles[] = { "big.txt", "small.txt", "empty.txt" };
+#define NUM_FILES (sizeof(kFiles) / sizeof(kFiles[0]))
+
+static int gFailures;
+
+static void fail(const char* what, const char* dir, const char* file)
+{
+    fprintf(stderr, "FAIL: %s: %s/%s\n", what, dir, file);
+    gFailures++;
+}
+
+static const ZipEntry* findEntry(const ZipArchive* pArchive,
+    const char* dir, const char* file)
+{
+    char name[256];
+
+    snprintf(name, sizeof(name), "%s/%s", dir, file);
+    return mzFindZipEntry(pArchive, name);
+}
+
+/*
+ * Read "pEntry" into a new buffer with "how": 0 for a ZipEntryReader,
+ * 1 for mzExtractZipEntryToBuffer(), 2 for mzExtractZipEntryToFile().
+ * Returns NULL on failure.
+ */
+static unsigned char* readEntry(const ZipArchive* pArchive,
+    const ZipEntry* pEntry, int how)
+{
+    long long len = mzGetZipEntryUncompLen(pEntry);
+    unsigned char* buf = malloc(len + 1);
+    bool ok = false;
+
+    if (buf == NULL)
+        return NULL;
+    if (how == 0) {
+        ZipEntryReader reader;
+        long long total = 0;
+        long n = 0;
+
+        if (mzOpenZipEntryReader(pArchive, pEntry, &reader)) {
+            /* one byte more than fits, to catch overlong output */
+            while (total <= len &&
+                    (n = mzReadZipEntryReader(&reader, buf + total,
+                            len + 1 - total)) > 0)
+                total += n;
+            mzCloseZipEntryReader(&reader);
+            ok = n == 0 && total == len;
+        }
+    } else if (how == 1) {
+        ok = mzExtractZipEntryToBuffer(pArchive, pEntry, buf);
+    } else {
+        FILE* fp = tmpfile();
+
+        if (fp != NULL) {
+            ok = mzExtractZipEntryToFile(pArchive, pEntry, fileno(fp)) &&
+                    fseek(fp, 0, SEEK_SET) == 0 &&
+                    fread(buf, 1, len + 1, fp) == (size_t) len;
+            fclose(fp);
+        }
+    }
+    if (!ok) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Compare the file "dir/file" under "root" with "expected".
+ */
+static bool checkFile(const char* root, const char* dir, const char* file,
+    const unsigned char* expected, long long len)
+{
+    char path[PATH_MAX];
+    unsigned char* buf = malloc(len + 1);
+    FILE* fp;
+    bool ok = false;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", root, dir, file);
+    fp = fopen(path, "rb");
+    if (fp != NULL && buf != NULL) {
+        ok = fread(buf, 1, len + 1, fp) == (size_t) len &&
+                memcmp(buf, expected, len) == 0;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    unlink(path);
+    free(buf);
+    return ok;
+}
+
+static void testCodecs(const char* fileName)
+{
+    ZipArchive archive;
+    unsigned char* expected[NUM_FILES];
+    char root[] = "/tmp/minzip_codec_test.XXXXXX";
+    char sub[PATH_MAX];
+    unsigned int c, f;
+    int how;
+
+    if (mzOpenZipArchive(fileName, &archive) != 0) {
+        fail("open", fileName, "");
+        return;
+    }
+    if (mkdtemp(root) == NULL) {
+        fail("mkdtemp", root, "");
+        mzCloseZipArchive(&archive);
+        return;
+    }
+
+    /* The stored copies are the reference.
+     */
+    for (f = 0; f < NUM_FILES; f++) {
+        const ZipEntry* pEntry = findEntry(&archive, "stored", kFiles[f]);
+        expected[f] = pEntry != NULL ? readEntry(&archive, pEntry, 0) : NULL;
+        if (expected[f] == NULL)
+            fail("read reference", "stored", kFiles[f]);
+    }
+
+    for (c = 0; c < NUM_CODECS; c++) {
+        const Codec* codec = &kCodecs[c];
+
+        for (f = 0; f < NUM_FILES; f++) {
+            const ZipEntry* pEntry = findEntry(&archive, codec->dir,
+                    kFiles[f]);
+
+            if (pEntry == NULL) {
+                fail("find", codec->dir, kFiles[f]);
+                continue;
+            }
+            if (pEntry->compression != codec->compression) {
+                fail("compression method", codec->dir, kFiles[f]);
+                continue;
+            }
+            if (mzIsZipEntryIntact(&archive, pEntry) != codec->supported)
+                fail("intact", codec->dir, kFiles[f]);
+            for (how = 0; how < 3; how++) {
+                unsigned char* buf = readEntry(&archive, pEntry, how);
+
+                if (!codec->supported) {
+                    if (buf != NULL)
+                        fail("unsupported method accepted", codec->dir,
+                                kFiles[f]);
+                } else if (buf == NULL || expected[f] == NULL ||
+                        memcmp(buf, expected[f],
+                                mzGetZipEntryUncompLen(pEntry)) != 0) {
+                    fail(how == 0 ? "reader" : how == 1 ? "buffer" : "file",
+                            codec->dir, kFiles[f]);
+                }
+                free(buf);
+            }
+        }
+
+        snprintf(sub, sizeof(sub), "%s/%s", root, codec->dir);
+        if (mkdir(sub, 0755) != 0) {
+            fail("mkdir", sub, "");
+            continue;
+        }
+        for (how = 0; how < 2; how++) {
+            int flags = how == 0 ? 0 : MZ_EXTRACT_PARALLEL;
+
+            if (mzExtractRecursive(&archive, codec->dir, sub, flags, NULL,
+                    NULL, NULL) != codec->supported) {
+                fail("extract recursive", codec->dir, "");
+            } else if (codec->supported) {
+                for (f = 0; f < NUM_FILES; f++) {
+                    const ZipEntry* pEntry = findEntry(&archive, "stored",
+                            kFiles[f]);
+                    if (pEntry != NULL && expected[f] != NULL &&
+                            !checkFile(root, codec->dir, kFiles[f],
+                                    expected[f],
+                                    mzGetZipEntryUncompLen(pEntry)))
+                        fail("extracted file", codec->dir, kFiles[f]);
+                }
+            }
+            for (f = 0; f < NUM_FILES; f++) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", sub, kFiles[f]);
+                unlink(path);
+            }
+        }
+        rmdir(sub);
+    }
+    rmdir(root);
+
+    for (f = 0; f < NUM_FILES; f++)
+        free(expected[f]);
+    mzCloseZipArchive(&archive);
+}
+
+static void testBadCrc(const char* fileName)
+{
+    ZipArchive archive;
+    unsigned int c;
+    int how;
+
+    if (mzOpenZipArchive(fileName, &archive) != 0) {
+        fail("open", fileName, "");
+        return;
+    }
+    for (c = 0; c < NUM_CODECS; c++) {
+        const ZipEntry* pEntry = findEntry(&archive, kCodecs[c].dir,
+                "big.txt");
+
+        if (pEntry == NULL) {
+            fail("find", kCodecs[c].dir, "big.txt");
+            continue;
+        }
+        if (mzIsZipEntryIntact(&archive, pEntry))
+            fail("bad CRC intact", kCodecs[c].dir, "big.txt");
+        /* (a ZipEntryReader doesn't check the CRC) */
+        for (how = 1; how < 3; how++) {
+            unsigned char* buf = readEntry(&archive, pEntry, how);
+            if (buf != NULL)
+                fail("bad CRC extracted", kCodecs[c].dir, "big.txt");
+            free(buf);
+        }
+    }
+    mzCloseZipArchive(&archive);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int c;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s codecs.zip badcrc.zip\n", argv[0]);
+        return 2;
+    }
+
+    printf("methods:");
+    for (c = 0; c < NUM_CODECS; c++) {
+        printf(" %s%s", kCodecs[c].dir,
+                kCodecs[c].supported ? "" : " (unsupported)");
+    }
+    printf("\n");
+
+    testCodecs(argv[1]);
+    testBadCrc(argv[2]);
+
+    printf("%s\n", gFailures == 0 ? "PASS" : "FAIL");
+    return gFailures == 0 ? 0 : 1;
+}
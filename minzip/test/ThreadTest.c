@@ -0,0 +1,217 @@
+/*
+ * Copyright 2026 The Android Open Source Project
+ *
+ * Stress test for concurrent reads from one ZipArchive.
+ *
+ * Opens each archive given on the command line, mapped and then with
+ * mzOpenZipArchiveDirOnly(), and has several threads read every entry
+ * at once -- with a ZipEntryReader, mzProcessZipEntryContents() and
+ * mzExtractZipEntryToBuffer() in turn -- checking each result against
+ * the CRC in the central directory.  Each thread starts at a different
+ * entry and uses a different read size, so the same entries are being
+ * read by several threads at any time.
+ *
+ * Usage: minzip_thread_test [-t threads] [-r rounds] archive.zip ...
+ * Exits nonzero if any read fails or any CRC doesn't match.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "minzip/Zip.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ROUNDS  4
+#define MAX_THREADS     64
+
+typedef struct {
+    const ZipArchive* pArchive;
+    int id;
+    int rounds;
+    unsigned int failures;
+    unsigned long long bytes;
+} TestThread;
+
+static bool crcFunction(const unsigned char* data, int dataLen, void* cookie)
+{
+    unsigned long* crc = (unsigned long*) cookie;
+
+    *crc = crc32(*crc, data, dataLen);
+    return true;
+}
+
+/*
+ * Read "pEntry" the way "how" says and check it against its CRC.
+ */
+static bool checkEntry(TestThread* t, const ZipEntry* pEntry, int how,
+    unsigned char* buf, long bufLen)
+{
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    long long total = 0;
+
+    if (how == 0) {
+        ZipEntryReader reader;
+        long n;
+
+        if (!mzOpenZipEntryReader(t->pArchive, pEntry, &reader))
+            return false;
+        while ((n = mzReadZipEntryReader(&reader, buf, bufLen)) > 0) {
+            crc = crc32(crc, buf, n);
+            total += n;
+        }
+        mzCloseZipEntryReader(&reader);
+        if (n < 0 || total != mzGetZipEntryUncompLen(pEntry))
+            return false;
+    } else if (how == 1) {
+        if (!mzProcessZipEntryContents(t->pArchive, pEntry, crcFunction,
+                &crc))
+            return false;
+        total = mzGetZipEntryUncompLen(pEntry);
+    } else {
+        long long len = mzGetZipEntryUncompLen(pEntry);
+        unsigned char* out = malloc(len > 0 ? len : 1);
+
+        if (out == NULL)
+            return false;
+        if (!mzExtractZipEntryToBuffer(t->pArchive, pEntry, out)) {
+            free(out);
+            return false;
+        }
+        crc = crc32(crc, out, len);
+        free(out);
+        total = len;
+    }
+
+    t->bytes += total;
+    return crc == (unsigned long) mzGetZipEntryCrc32(pEntry);
+}
+
+static void* testThread(void* arg)
+{
+    TestThread* t = (TestThread*) arg;
+    unsigned int count = mzZipEntryCount(t->pArchive);
+    /* odd read sizes, so reads end mid-block at different places */
+    long bufLen = 1000 + t->id * 7919;
+    unsigned char* buf = malloc(bufLen);
+    int round;
+    unsigned int i;
+
+    if (buf == NULL) {
+        t->failures++;
+        return NULL;
+    }
+    for (round = 0; round < t->rounds; round++) {
+        for (i = 0; i < count; i++) {
+            unsigned int index = (i + t->id * 37 + round * 11) % count;
+            const ZipEntry* pEntry = mzGetZipEntryAt(t->pArchive, index);
+            int how = (index + t->id + round) % 3;
+
+            if (!checkEntry(t, pEntry, how, buf, bufLen)) {
+                UnterminatedString name =
+                        mzGetZipEntryFileName(t->pArchive, pEntry);
+                fprintf(stderr, "thread %d: bad read of '%.*s' (method %d)\n",
+                        t->id, (int) name.len, name.str, how);
+                t->failures++;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Run the threads on one opened archive.  Returns the number of
+ * failures.
+ */
+static unsigned int runThreads(const ZipArchive* pArchive, const char* what,
+    int numThreads, int rounds)
+{
+    pthread_t threads[MAX_THREADS];
+    TestThread state[MAX_THREADS];
+    unsigned int failures = 0;
+    unsigned long long bytes = 0;
+    int started, i;
+
+    for (started = 0; started < numThreads; started++) {
+        state[started].pArchive = pArchive;
+        state[started].id = started;
+        state[started].rounds = rounds;
+        state[started].failures = 0;
+        state[started].bytes = 0;
+        if (pthread_create(&threads[started], NULL, testThread,
+                &state[started]) != 0) {
+            fprintf(stderr, "can't start thread %d\n", started);
+            failures++;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        failures += state[i].failures;
+        bytes += state[i].bytes;
+    }
+    printf("  %s: %d threads, %u entries, %llu KB read, %u failures\n",
+            what, started, mzZipEntryCount(pArchive), bytes / 1024, failures);
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    int numThreads = DEFAULT_THREADS;
+    int rounds = DEFAULT_ROUNDS;
+    unsigned int failures = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:r:")) != -1) {
+        switch (opt) {
+        case 't':
+            numThreads = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc || numThreads < 1 || numThreads > MAX_THREADS ||
+            rounds < 1)
+        goto usage;
+
+    for (i = optind; i < argc; i++) {
+        ZipArchive archive;
+        int err;
+
+        printf("%s\n", argv[i]);
+
+        err = mzOpenZipArchive(argv[i], &archive);
+        if (err != 0) {
+            fprintf(stderr, "can't open %s (%s)\n", argv[i], strerror(err));
+            failures++;
+            continue;
+        }
+        failures += runThreads(&archive, "mapped", numThreads, rounds);
+        mzCloseZipArchive(&archive);
+
+        err = mzOpenZipArchiveDirOnly(argv[i], &archive);
+        if (err != 0) {
+            fprintf(stderr, "can't open %s (%s)\n", argv[i], strerror(err));
+            failures++;
+            continue;
+        }
+        failures += runThreads(&archive, "pread", numThreads, rounds);
+        mzCloseZipArchive(&archive);
+    }
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+
+usage:
+    fprintf(stderr, "usage: %s [-t threads] [-r rounds] archive.zip ...\n",
+            argv[0]);
+    return 2;
+}
@@ -0,0 +1,24 @@
+#!/bin/bash
+#
+# Run the minzip host tests against the archives in testdata.  Build
+# them first (mmm bootable/recovery/minzip); the binaries are looked
+# for in $ANDROID_HOST_OUT/bin, or the directory given as $1.
+
+BIN=${1:-$ANDROID_HOST_OUT/bin}
+DATA=$(dirname "$0")/testdata
+
+fail() {
+  echo
+  echo FAIL: $1
+  exit 1
+}
+
+echo "concurrent reads..."
+$BIN/minzip_thread_test $DATA/threads.zip || fail "concurrent reads"
+
+echo
+echo "codecs..."
+$BIN/minzip_codec_test $DATA/codecs.zip $DATA/badcrc.zip || fail "codecs"
+
+echo
+echo PASS
@@ -817,8 +817,13 @@ static void update_directory(const char* path)
 			dirs[d_size][name_len+1] = '\0';
 			++d_size;
 		} 
-		else if (de->d_type == DT_REG &&	name_len >= 4 && strncasecmp(de->d_name + (name_len-4), ".zip", 4) == 0) 
+		else if (de->d_type == DT_REG &&
+			((name_len >= 4 && strncasecmp(de->d_name + (name_len-4), ".zip", 4) == 0) ||
+			 (name_len >= 8 && strncasecmp(de->d_name + (name_len-8), ".zip.001", 8) == 0))) 
 		{
+			// pkg.zip.001 is the first part of a package cut up to fit on
+			// FAT32; minzip opens the rest (and the pkg.z01, ... of a split
+			// pkg.zip) itself
 			if (z_size >= z_alloc) 
 			{
 				z_alloc *= 2;
@@ -24,6 +24,15 @@ LOCAL_STATIC_LIBRARIES += libext4_utils_static libsparse_static libz
 
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
 LOCAL_STATIC_LIBRARIES += libapplypatch libedify libminzip libz
+ifeq ($(MINZIP_USE_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+ifeq ($(MINZIP_HAVE_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+ifeq ($(MINZIP_HAVE_LZ4),true)
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
 LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += libminelf libselinux
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
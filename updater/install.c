@@ -16,6 +16,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +34,7 @@
 #include "edify/expr.h"
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
+#include "minzip/SysUtil.h"
 #include "minelf/Retouch.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
@@ -300,9 +302,20 @@ Value* PackageExtractDirFn(const char* name, State* state,
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
+    // Large trees (e.g. /system) are dominated by inflate and fs metadata
+    // work, so spread the files over all CPUs.
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      MZ_EXTRACT_FILES_ONLY |
+                                      MZ_EXTRACT_PARALLEL, &timestamp,
                                       NULL, NULL);
+
+    // The files were written without O_SYNC; make the whole tree durable
+    // at once before reporting success.
+    if (success && sysSyncFilesystem(dest_path) != 0) {
+        fprintf(stderr, "%s: failed to sync %s: %s\n",
+                name, dest_path, strerror(errno));
+        success = false;
+    }
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
@@ -335,13 +348,19 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done2;
         }
 
-        FILE* f = fopen(dest_path, "wb");
+        // Read-write, so large entries can be inflated into a mapping.
+        FILE* f = fopen(dest_path, "w+b");
         if (f == NULL) {
             fprintf(stderr, "%s: can't open %s for write: %s\n",
                     name, dest_path, strerror(errno));
             goto done2;
         }
-        success = mzExtractZipEntryToFile(za, entry, fileno(f));
+        success = mzExtractZipEntryToMappedFile(za, entry, fileno(f));
+        if (success && fsync(fileno(f)) != 0) {
+            fprintf(stderr, "%s: failed to sync %s: %s\n",
+                    name, dest_path, strerror(errno));
+            success = false;
+        }
         fclose(f);
 
       done2:
@@ -367,7 +386,13 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done1;
         }
 
-        v->size = mzGetZipEntryUncompLen(entry);
+        long long uncompLen = mzGetZipEntryUncompLen(entry);
+        if (uncompLen > SSIZE_MAX) {
+            fprintf(stderr, "%s: %s is too large (%lld bytes) to load\n",
+                    name, zip_path, uncompLen);
+            goto done1;
+        }
+        v->size = uncompLen;
         v->data = malloc(v->size);
         if (v->data == NULL) {
             fprintf(stderr, "%s: failed to allocate %ld bytes for %s\n",
@@ -582,7 +607,11 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
         }
 
         for (i = 4; i < argc; ++i) {
-            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
+            if (dirSetHierarchyPermissions(args[i], uid, gid,
+                                           dir_mode, file_mode) < 0) {
+                fprintf(stderr, "%s: setting permissions under %s failed: %s\n",
+                        name, args[i], strerror(errno));
+            }
         }
     } else {
         int mode = strtoul(args[2], &end, 0);
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -32,6 +33,11 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Parsed copy of the package's directory, written when recovery opens
+// the package, so we don't have to parse it again.  Keep in sync with
+// PACKAGE_INDEX_FILE in recovery's install.c.
+#define PACKAGE_INDEX_FILE "/cache/recovery/package.idx"
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -65,7 +71,8 @@ int main(int argc, char** argv) {
     char* package_data = argv[3];
     ZipArchive za;
     int err;
-    err = mzOpenZipArchive(package_data, &za);
+    err = mzOpenZipArchiveIndexed(package_data, PACKAGE_INDEX_FILE, false,
+                                  &za);
     if (err != 0) {
         fprintf(stderr, "failed to open package %s: %s\n",
                 package_data, strerror(err));
@@ -78,8 +85,13 @@ int main(int argc, char** argv) {
         return 4;
     }
 
+    if (script_entry->uncompLen > INT_MAX - 1) {
+        fprintf(stderr, "%s in %s is too large\n", SCRIPT_NAME, package_data);
+        return 5;
+    }
     char* script = malloc(script_entry->uncompLen+1);
-    if (!mzReadZipEntry(&za, script_entry, script, script_entry->uncompLen)) {
+    if (script == NULL ||
+        !mzReadZipEntry(&za, script_entry, script, script_entry->uncompLen)) {
         fprintf(stderr, "failed to read script from package\n");
         return 5;
     }